@@ -0,0 +1,82 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "classify.h"
+#include <netinet/in.h>
+#include <algorithm>
+
+// Game server ports of the default redirections file: IWANGO (9500), IGP/visual concepts (11000, 12301, 15303).
+// Replaced by the ports of the redirections when they are loaded.
+static std::vector<uint16_t> gamePorts { 9500, 11000, 12301, 15303 };
+// DSCP values
+constexpr unsigned DSCP_CS1 = 8;
+constexpr unsigned DSCP_CS4 = 32;
+// TCP flags
+constexpr uint8_t TCP_FIN = 0x01;
+constexpr uint8_t TCP_RST = 0x04;
+
+void setGamePorts(const std::vector<uint16_t>& ports)
+{
+	gamePorts = ports;
+}
+
+static bool isGamePort(uint16_t port)
+{
+	return std::find(gamePorts.begin(), gamePorts.end(), port) != gamePorts.end();
+}
+
+FrameClass classifyFrame(const uint8_t *frame, size_t len)
+{
+	if (len < 14)
+		return FRAME_BULK;
+	unsigned etherType = frame[12] << 8 | frame[13];
+	if (etherType == 0x0806)	// ARP
+		return FRAME_GAME;
+	if (etherType != 0x0800 || len < 14 + 20)
+		return FRAME_BULK;
+	const uint8_t *ip = &frame[14];
+	unsigned dscp = ip[1] >> 2;
+	if (dscp == DSCP_CS1)
+		return FRAME_BULK;
+	if (dscp >= DSCP_CS4)
+		return FRAME_GAME;
+	switch (ip[9])
+	{
+	case IPPROTO_ICMP:
+	case IPPROTO_UDP:
+		return FRAME_GAME;
+	case IPPROTO_TCP:
+		{
+			// The data segments of a flow all get the same class so that they stay in order
+			size_t ihl = (ip[0] & 0xf) * 4u;
+			bool firstFragment = ((ip[6] << 8 | ip[7]) & 0x1fff) == 0;
+			if (!firstFragment || len < 14 + ihl + 20)
+				return FRAME_BULK;
+			const uint8_t *tcp = ip + ihl;
+			if (isGamePort((uint16_t)(tcp[0] << 8 | tcp[1])) || isGamePort((uint16_t)(tcp[2] << 8 | tcp[3])))
+				return FRAME_GAME;
+			// Segments without data, except FIN and RST that must follow the data, can go ahead
+			unsigned totalLength = ip[2] << 8 | ip[3];
+			size_t headers = ihl + (tcp[12] >> 4) * 4u;
+			if (totalLength == headers && (tcp[13] & (TCP_FIN | TCP_RST)) == 0)
+				return FRAME_GAME;
+			return FRAME_BULK;
+		}
+	default:
+		return FRAME_BULK;
+	}
+}
@@ -0,0 +1,33 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+enum FrameClass {
+	FRAME_GAME,		// latency sensitive
+	FRAME_BULK,		// downloads, web pages...
+};
+
+// Classify an ethernet frame sent through the BBA tunnel.
+// Game frames: ARP, ICMP, UDP, TCP to or from a game port, TCP acks without data,
+// and IP packets with a DSCP of CS4 or above. CS1 (lower effort) is always bulk.
+FrameClass classifyFrame(const uint8_t *frame, size_t len);
+// Set the game server ports. The ports of the default redirections file are used otherwise.
+void setGamePorts(const std::vector<uint16_t>& ports);
@@ -25,8 +25,10 @@
 // iptables -t nat -A PREROUTING -i tap0 -d 172.20.1.1 -j DNAT --to-destination 192.168.1.2
 // Change source from console address to local DCNet address on all packets sent to tap0
 // iptables -t nat -A POSTROUTING -o tap0 -s 192.168.1.2 -j SNAT --to 172.20.1.1
-// FIXME need to know the assigned IP address. DCNETv2?
+// The console IP address assigned by the access point is printed once connected.
 //
+#include "prolog.h"
+#include "framequeue.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -47,10 +49,32 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <assert.h>
+#include <time.h>
+#include <string>
 
 #define DCNET_HOST "dcnet.flyca.st"
 #define DCNET_PORT 7655
+#define MAX_REDIRECTS 3
+// Access points that don't support a protocol version close the connection as soon as they read the prolog.
+// A later close is not a version problem: pending connection evicted, prolog timeout...
+#define VERSION_CLOSE_TIME 1000000
+// Output queue parameters, see ethtap
+#define QUEUE_TARGET 20000
+#define QUEUE_INTERVAL 100000
+#define QUEUE_DEADLINE 500000
+#define QUEUE_MAX_BYTES (64 * 1024)
+#define NOTSENT_LOWAT (16 * 1024)
+#define TAP_READ_BATCH 8
 const char *tap_interface = "tap0";
+// Frames read from the tap, waiting to be sent to the access point
+TunnelQueue outputQueue(QUEUE_TARGET, QUEUE_INTERVAL, QUEUE_DEADLINE, QUEUE_MAX_BYTES);
+
+int64_t getTimeUs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 bool setNonBlocking(int fd)
 {
@@ -65,41 +89,129 @@ bool setNonBlocking(int fd)
 	return true;
 }
 
-int main(int argc, char *argv[])
+// Resolve the server name and connect
+int connectServer(const char *host, uint16_t port)
 {
-	if (argc >= 2)
-		tap_interface = argv[1];
-	fprintf(stderr, "DCNet BBA starting on interface %s\n", tap_interface);
-
-	// Resolve server name
 	addrinfo hints {};
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags |= AI_CANONNAME;
 	addrinfo *result;
-	if (getaddrinfo(DCNET_HOST, nullptr, &hints, &result))
+	if (getaddrinfo(host, nullptr, &hints, &result))
 		error(-1, errno, "getaddrinfo");
 	if (result == nullptr) {
-		fprintf(stderr, "%s: host not found\n", DCNET_HOST);
-		return -1;
+		fprintf(stderr, "%s: host not found\n", host);
+		exit(-1);
 	}
 	char s[100];
 	sockaddr_in *serverAddress = (sockaddr_in *)result->ai_addr;
 	inet_ntop(result->ai_family, &serverAddress->sin_addr, s, 100);
-	serverAddress->sin_port = htons(DCNET_PORT);
-	printf("connecting to %s (%s)\n", s, result->ai_canonname);
+	serverAddress->sin_port = htons(port);
+	printf("connecting to %s:%d (%s)\n", s, port, result->ai_canonname);
 
-	// Connect
 	int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (connect(sock, (const sockaddr *)serverAddress, sizeof(sockaddr)))
 		error(-1, errno, "connect");
+	freeaddrinfo(result);
 	int optval = 1;
 	setsockopt(sock, SOL_TCP, TCP_NODELAY, &optval, (socklen_t)sizeof(optval));
 
-	// Write prolog
-	uint8_t prolog[] = { 6, 0, 'D', 'C', 'N', 'E', 'T', 1 };
-	if (write(sock, prolog, sizeof(prolog)) != sizeof(prolog))
-		error(-1, errno, "write(prolog)");
+	return sock;
+}
+
+// Read the access point reply to a version 2+ prolog, just sent.
+// Returns the reply status, or -1 if the access point doesn't support this version.
+int readPrologReply(int sock, std::string& host, uint16_t& port, time_t& heartbeat)
+{
+	int64_t sent = getTimeUs();
+	timeval tv {};
+	tv.tv_sec = 10;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	uint8_t reply[PROLOG_REPLY_MAX];
+	uint16_t size;
+	ssize_t ret = recv(sock, &size, sizeof(size), MSG_WAITALL);
+	if (ret == 0)
+	{
+		if (getTimeUs() - sent < VERSION_CLOSE_TIME)
+			return -1;
+		fprintf(stderr, "connection closed by the access point\n");
+		exit(-1);
+	}
+	if (ret != sizeof(size) || size < 7 || size > sizeof(reply) - 2
+			|| recv(sock, &reply[2], size, MSG_WAITALL) != size
+			|| memcmp(&reply[2], "DCNET", 5))
+		error(-1, errno, "invalid prolog reply");
+	tv.tv_sec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	const uint8_t *data = &reply[9];
+	size_t len = size - 7u;
+	switch (reply[8])
+	{
+	case PROLOG_ACCEPT:
+		if (len >= 4)
+			printf("console address is %s\n", inet_ntoa(*(const in_addr *)data));
+		if (len >= 6)
+			heartbeat = data[4] << 8 | data[5];
+		return PROLOG_ACCEPT;
+	case PROLOG_REJECT:
+		if (len >= 1 && data[0] == REJECT_VERSION)
+			return -1;
+		if (len >= 1)
+			fprintf(stderr, "connection rejected: %.*s (%d)\n", (int)len - 1, (const char *)&data[1], data[0]);
+		return PROLOG_REJECT;
+	case PROLOG_REDIRECT:
+		if (len < 3) {
+			fprintf(stderr, "invalid redirect\n");
+			return PROLOG_REJECT;
+		}
+		port = (uint16_t)(data[0] << 8 | data[1]);
+		host = std::string((const char *)&data[2], len - 2);
+		printf("redirected to %s:%d\n", host.c_str(), port);
+		return PROLOG_REDIRECT;
+	default:
+		fprintf(stderr, "unknown prolog reply %d\n", reply[8]);
+		return PROLOG_REJECT;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 2)
+		tap_interface = argv[1];
+	fprintf(stderr, "DCNet BBA starting on interface %s\n", tap_interface);
+
+	// Connect and write the prolog, following the redirections of overloaded access points
+	std::string host = DCNET_HOST;
+	uint16_t port = DCNET_PORT;
+	uint8_t version = PROLOG_V3;
+	// Heartbeat interval, 0 if not supported by the access point
+	time_t heartbeat = 0;
+	int sock;
+	for (int redirects = 0;; redirects++)
+	{
+		sock = connectServer(host.c_str(), port);
+		uint8_t prolog[] = { 6, 0, 'D', 'C', 'N', 'E', 'T', version };
+		if (write(sock, prolog, sizeof(prolog)) != sizeof(prolog))
+			error(-1, errno, "write(prolog)");
+		if (version == PROLOG_V1)
+			break;
+		int status = readPrologReply(sock, host, port, heartbeat);
+		if (status == PROLOG_ACCEPT)
+			break;
+		close(sock);
+		if (status == -1) {
+			// Older access point
+			version--;
+			printf("using protocol version %d\n", version);
+			continue;
+		}
+		if (status == PROLOG_REJECT)
+			return -1;
+		if (redirects == MAX_REDIRECTS) {
+			fprintf(stderr, "too many redirections\n");
+			return -1;
+		}
+	}
 
 	// Now open the tap device
 	int tap_fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
@@ -123,19 +235,49 @@ int main(int argc, char *argv[])
 	setNonBlocking(tap_fd);
 	setNonBlocking(sock);
 
+	// Keep frames in the output queue, where game frames can go first, rather than in the socket
+	int lowat = NOTSENT_LOWAT;
+	setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+	if (heartbeat > 0) {
+		unsigned userTimeout = (unsigned)heartbeat * 3000;
+		setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+	}
+
 	uint8_t inbuf[1600];
 	uint8_t outbuf[1600];
 	unsigned inbuflen = 0;
 	unsigned outbuflen = 0;
+	time_t lastSent = time(nullptr);
+	time_t lastReceived = lastSent;
+	time_t lastHeartbeat = lastSent;
 	for (;;)
 	{
+		// Skip heartbeats
+		while (inbuflen >= 2 && *(uint16_t *)&inbuf[0] == 0)
+		{
+			inbuflen -= 2;
+			memmove(inbuf, inbuf + 2, (size_t)inbuflen);
+		}
+		if (heartbeat > 0)
+		{
+			time_t now = time(nullptr);
+			if (now - lastReceived >= heartbeat * 3) {
+				fprintf(stderr, "access point not responding\n");
+				break;
+			}
+			if (outbuflen == 0 && now - lastHeartbeat >= heartbeat
+					&& (now - lastSent >= heartbeat || now - lastReceived >= heartbeat))
+			{
+				*(uint16_t *)&outbuf[0] = 0;
+				outbuflen = 2;
+				lastHeartbeat = now;
+			}
+		}
 		fd_set readfds;
 		FD_ZERO(&readfds);
 		if (inbuflen < sizeof(inbuf))
 			FD_SET(sock, &readfds);
-		if (outbuflen == 0)
-			// Don't read from tap until the current frame is sent out
-			FD_SET(tap_fd, &readfds);
+		FD_SET(tap_fd, &readfds);
 
 		fd_set writefds;
 		FD_ZERO(&writefds);
@@ -147,11 +289,12 @@ int main(int argc, char *argv[])
 			if (inbuflen >= framelen + 2u)
 				FD_SET(tap_fd, &writefds);
 		}
-		if (outbuflen > 0)
+		if (outbuflen > 0 || !outputQueue.empty())
 			FD_SET(sock, &writefds);
 
 		int nfds = (sock > tap_fd ? sock : tap_fd) + 1;
-		if (select(nfds, &readfds, &writefds, nullptr, nullptr) == -1)
+		timeval tv { 1, 0 };
+		if (select(nfds, &readfds, &writefds, nullptr, heartbeat > 0 ? &tv : nullptr) == -1)
 		{
 			if (errno == EINTR)
 				continue;
@@ -160,26 +303,29 @@ int main(int argc, char *argv[])
 		}
 		if (FD_ISSET(tap_fd, &readfds))
 		{
-			ssize_t ret = read(tap_fd, outbuf + 2, sizeof(outbuf) - 2u);
-			if (ret < 0)
+			bool tapClosed = false;
+			for (int i = 0; i < TAP_READ_BATCH; i++)
 			{
-				if (errno != EINTR && errno != EWOULDBLOCK) {
-					perror("read(tap)");
+				uint8_t frame[FrameQueue::MAX_FRAME_SIZE];
+				ssize_t ret = read(tap_fd, frame, sizeof(frame));
+				if (ret < 0)
+				{
+					if (errno != EINTR && errno != EWOULDBLOCK) {
+						perror("read(tap)");
+						tapClosed = true;
+					}
 					break;
 				}
-				ret = 0;
+				else if (ret == 0) {
+					fprintf(stderr, "tap read EOF\n");
+					tapClosed = true;
+					break;
+				}
+				//printf("Out frame: %zd\n", ret);
+				outputQueue.push(frame, (size_t)ret, getTimeUs());
 			}
-			else if (ret == 0) {
-				fprintf(stderr, "tap read EOF\n");
+			if (tapClosed)
 				break;
-			}
-			if (ret > 0)
-			{
-				printf("Out frame: %zd\n", ret);
-				*(uint16_t *)&outbuf[0] = ret;
-				outbuflen = ret + 2;
-				FD_SET(sock, &writefds);
-			}
 		}
 		if (FD_ISSET(sock, &readfds))
 		{
@@ -199,31 +345,43 @@ int main(int argc, char *argv[])
 			if (ret > 0) {
 				inbuflen += ret;
 				FD_SET(tap_fd, &writefds);
+				lastReceived = time(nullptr);
 			}
 		}
 		if (FD_ISSET(tap_fd, &writefds))
 		{
 			uint16_t framelen = *(uint16_t *)&inbuf[0];
-			assert(inbuflen >= framelen + 2u);
-			printf("In frame: %d\n", framelen);
-			ssize_t ret = write(tap_fd, inbuf + 2, framelen);
-			if (ret < 0) {
-				if (errno != EINTR && errno != EWOULDBLOCK) {
-					perror("write(tap)");
-					break;
+			// Heartbeats and partial frames are left in inbuf
+			if (inbuflen >= 2 && framelen > 0 && inbuflen >= framelen + 2u)
+			{
+				//printf("In frame: %d\n", framelen);
+				ssize_t ret = write(tap_fd, inbuf + 2, framelen);
+				if (ret < 0) {
+					if (errno != EINTR && errno != EWOULDBLOCK) {
+						perror("write(tap)");
+						break;
+					}
+					ret = 0;
+				}
+				if (ret > 0)
+				{
+					if (ret != framelen)
+						fprintf(stderr, "WARNING: tap write truncated %d -> %zd\n", framelen, ret);
+					inbuflen -= framelen + 2;
+					if (inbuflen > 0)
+						memmove(inbuf, inbuf + framelen + 2, (size_t)inbuflen);
 				}
-				ret = 0;
 			}
-			if (ret > 0)
-			{
-				if (ret != framelen)
-					fprintf(stderr, "WARNING: tap write truncated %d -> %zd\n", framelen, ret);
-				inbuflen -= framelen + 2;
-				if (inbuflen > 0)
-					memmove(inbuf, inbuf + framelen + 2, (size_t)inbuflen);
+		}
+		if (FD_ISSET(sock, &writefds) && outbuflen == 0)
+		{
+			size_t framelen = outputQueue.pop(outbuf + 2, sizeof(outbuf) - 2u, getTimeUs());
+			if (framelen > 0) {
+				*(uint16_t *)&outbuf[0] = (uint16_t)framelen;
+				outbuflen = (unsigned)framelen + 2;
 			}
 		}
-		if (FD_ISSET(sock, &writefds))
+		if (FD_ISSET(sock, &writefds) && outbuflen > 0)
 		{
 			ssize_t ret = write(sock, outbuf, (size_t)outbuflen);
 			if (ret < 0) {
@@ -235,14 +393,15 @@ int main(int argc, char *argv[])
 			}
 			if (ret > 0)
 			{
-				printf("Out sent(%d) -> %zd\n", outbuflen, ret);
+				//printf("Out sent(%d) -> %zd\n", outbuflen, ret);
+				lastSent = time(nullptr);
 				outbuflen -= ret;
 				if (outbuflen > 0)
 					memmove(outbuf, outbuf + ret, (size_t)outbuflen);
 			}
 		}
 	}
-	fprintf(stderr, "DCNet BBA stopping\n");
+	fprintf(stderr, "DCNet BBA stopping. %lu stale frames dropped\n", (unsigned long)outputQueue.droppedFrames());
 	close(tap_fd);
 	close(sock);
 	return 0;
@@ -0,0 +1,443 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+// discoping load generator.
+// Sends a mix of PING, DISCOVER and invalid packets from many source ports
+// and reports the reply rate, loss and PING latency.
+//
+// Example: discoping -r 1000 17655 & discobench -p 17655 -d 10 -m ping=8,discover=2,invalid=1
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// discoping protocol. Must match discoping.c
+const uint32_t MAGIC = 0xDC15C001;
+#define PING 1
+#define PONG 2
+#define DISCOVER 3
+#define LOAD_VERSION 1
+
+#define BATCH_SIZE 32
+#define MAX_SOCKETS 1024
+#define MAX_SAMPLES (16 * 1024 * 1024)
+#define DRAIN_TIME 1	// seconds to wait for late replies
+
+enum {
+	KIND_PING,
+	KIND_DISCOVER,
+	KIND_EXT_DISCOVER,
+	KIND_INVALID,
+	KIND_COUNT
+};
+const char *kindNames[KIND_COUNT] = { "ping", "discover", "extdiscover", "invalid" };
+unsigned weights[KIND_COUNT] = { 1, 1, 0, 0 };
+// Packet kinds in send order, following the weights
+int schedule[256];
+int scheduleLen;
+
+struct sockaddr_in target;
+int socketCount = 64;
+int duration = 10;
+unsigned long rate;		// packets per second, 0 for as fast as possible
+int *sockets;
+int epollFd;
+
+atomic_int sending = 1;
+uint64_t sent[KIND_COUNT];
+uint64_t sendErrors;
+// Updated by the receiver thread
+uint64_t pongs;
+uint64_t discoReplies;
+uint64_t extDiscoReplies;
+uint64_t unexpected;
+uint32_t *samples;		// PING latencies in nanoseconds
+uint64_t sampleCount;
+
+void error(const char *str)
+{
+	perror(str);
+	exit(1);
+}
+
+static uint64_t getTimeNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Build a packet of the given kind. Returns its size.
+static size_t buildPacket(uint8_t *buf, int kind, uint64_t seq)
+{
+	memcpy(buf, &MAGIC, sizeof(MAGIC));
+	switch (kind)
+	{
+	case KIND_PING:
+		{
+			buf[4] = PING;
+			uint64_t now = getTimeNs();
+			memcpy(&buf[5], &now, sizeof(now));
+			return 13;
+		}
+	case KIND_DISCOVER:
+		buf[4] = DISCOVER;
+		return 5;
+	case KIND_EXT_DISCOVER:
+		buf[4] = DISCOVER;
+		buf[5] = LOAD_VERSION;
+		return 6;
+	default:
+		// rotate through the different kinds of malformed packets
+		switch (seq % 4)
+		{
+		case 0:		// bad magic
+			buf[0] ^= 0xff;
+			buf[4] = PING;
+			return 13;
+		case 1:		// bad op
+			buf[4] = 0x7f;
+			return 5;
+		case 2:		// too short
+			return 3;
+		default:	// bad ping size
+			buf[4] = PING;
+			memset(&buf[5], 0, 10);
+			return 15;
+		}
+	}
+}
+
+void *receiverThread(void *arg)
+{
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	uint8_t data[BATCH_SIZE][600];
+	uint64_t stopTime = 0;
+	for (;;)
+	{
+		if (!atomic_load(&sending))
+		{
+			if (stopTime == 0)
+				stopTime = getTimeNs() + DRAIN_TIME * 1000000000ull;
+			else if (getTimeNs() >= stopTime)
+				break;
+		}
+		struct epoll_event events[64];
+		int n = epoll_wait(epollFd, events, 64, 100);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("epoll_wait");
+		}
+		for (int e = 0; e < n; e++)
+		{
+			int fd = events[e].data.fd;
+			for (;;)
+			{
+				for (int i = 0; i < BATCH_SIZE; i++)
+				{
+					iovs[i].iov_base = data[i];
+					iovs[i].iov_len = sizeof(data[i]);
+					memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+					msgs[i].msg_hdr.msg_iov = &iovs[i];
+					msgs[i].msg_hdr.msg_iovlen = 1;
+				}
+				int count = recvmmsg(fd, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+				if (count <= 0)
+					break;
+				uint64_t now = getTimeNs();
+				for (int i = 0; i < count; i++)
+				{
+					const uint8_t *p = data[i];
+					unsigned len = msgs[i].msg_len;
+					if (len < 5 || memcmp(p, &MAGIC, sizeof(MAGIC))) {
+						unexpected++;
+						continue;
+					}
+					if (p[4] == PONG && len == 13)
+					{
+						uint64_t stamp;
+						memcpy(&stamp, &p[5], sizeof(stamp));
+						pongs++;
+						if (sampleCount < MAX_SAMPLES && stamp <= now)
+							samples[sampleCount++] = (uint32_t)(now - stamp > UINT32_MAX ? UINT32_MAX : now - stamp);
+					}
+					else if (p[4] == DISCOVER && len >= 6 && p[5] == LOAD_VERSION)
+						extDiscoReplies++;
+					else if (p[4] == DISCOVER)
+						discoReplies++;
+					else
+						unexpected++;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+static void sendLoop()
+{
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	uint8_t data[BATCH_SIZE][16];
+	int kinds[BATCH_SIZE];
+	uint64_t start = getTimeNs();
+	uint64_t end = start + (uint64_t)duration * 1000000000;
+	uint64_t total = 0;
+	int sock = 0;
+	for (;;)
+	{
+		uint64_t now = getTimeNs();
+		if (now >= end)
+			break;
+		if (rate != 0)
+		{
+			// pace the batches
+			uint64_t due = start + total * 1000000000 / rate;
+			if (due > now)
+			{
+				struct timespec ts = { (time_t)(due / 1000000000), (long)(due % 1000000000) };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			}
+		}
+		for (int i = 0; i < BATCH_SIZE; i++)
+		{
+			kinds[i] = schedule[(total + (uint64_t)i) % (uint64_t)scheduleLen];
+			iovs[i].iov_base = data[i];
+			iovs[i].iov_len = buildPacket(data[i], kinds[i], total + (uint64_t)i);
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &target;
+			msgs[i].msg_hdr.msg_namelen = sizeof(target);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int count = sendmmsg(sockets[sock], msgs, BATCH_SIZE, 0);
+		if (count < 0) {
+			sendErrors++;
+			count = 0;
+		}
+		for (int i = 0; i < count; i++)
+			sent[kinds[i]]++;
+		total += BATCH_SIZE;
+		sock = (sock + 1) % socketCount;
+	}
+	atomic_store(&sending, 0);
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double percent)
+{
+	if (sampleCount == 0)
+		return 0;
+	return samples[(uint64_t)((double)(sampleCount - 1) * percent / 100)] / 1000.0;
+}
+
+static double loss(uint64_t sentCount, uint64_t received)
+{
+	if (sentCount == 0)
+		return 0;
+	return sentCount > received ? (double)(sentCount - received) * 100.0 / (double)sentCount : 0;
+}
+
+static void parseMix(char *mix)
+{
+	memset(weights, 0, sizeof(weights));
+	for (char *item = strtok(mix, ","); item != NULL; item = strtok(NULL, ","))
+	{
+		char *eq = strchr(item, '=');
+		unsigned weight = 1;
+		if (eq != NULL) {
+			*eq = '\0';
+			weight = (unsigned)atoi(eq + 1);
+		}
+		int kind = 0;
+		while (kind < KIND_COUNT && strcmp(item, kindNames[kind]))
+			kind++;
+		if (kind == KIND_COUNT || weight > 100) {
+			fprintf(stderr, "Invalid mix item: %s\n", item);
+			exit(1);
+		}
+		weights[kind] = weight;
+	}
+}
+
+// Interleave the packet kinds according to their weights
+static void buildSchedule()
+{
+	unsigned sum = 0;
+	for (int k = 0; k < KIND_COUNT; k++)
+		sum += weights[k];
+	if (sum == 0 || sum > sizeof(schedule) / sizeof(schedule[0])) {
+		fprintf(stderr, "Invalid mix\n");
+		exit(1);
+	}
+	// smooth weighted round robin
+	int credit[KIND_COUNT] = { 0 };
+	for (unsigned i = 0; i < sum; i++)
+	{
+		int best = 0;
+		for (int k = 0; k < KIND_COUNT; k++)
+		{
+			credit[k] += (int)weights[k];
+			if (credit[k] > credit[best])
+				best = k;
+		}
+		credit[best] -= (int)sum;
+		schedule[scheduleLen++] = best;
+	}
+}
+
+static void openSockets()
+{
+	sockets = calloc((size_t)socketCount, sizeof(int));
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (sockets == NULL || epollFd < 0)
+		error("setup");
+	// Spread local sources over loopback addresses so that they don't share a DISCOVER rate limiter
+	int loopback = (ntohl(target.sin_addr.s_addr) >> 24) == 127;
+	for (int i = 0; i < socketCount; i++)
+	{
+		sockets[i] = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+		if (sockets[i] < 0)
+			error("socket");
+		int size = 1024 * 1024;
+		setsockopt(sockets[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		if (loopback)
+			addr.sin_addr.s_addr = htonl(0x7f010001 + (uint32_t)(i / 254) * 256 + (uint32_t)(i % 254));
+		if (bind(sockets[i], (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			error("bind");
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = sockets[i] };
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sockets[i], &event) < 0)
+			error("epoll_ctl");
+	}
+}
+
+static void usage(const char *progName)
+{
+	fprintf(stderr, "usage: %s [-H <host>] [-p <port>] [-d <seconds>] [-r <packets/s>] [-s <sockets>] [-m <mix>]\n", progName);
+	fprintf(stderr, "Defaults: host 127.0.0.1, port 7655, 10 seconds, unlimited rate, 64 sockets\n");
+	fprintf(stderr, "-m: comma-separated list of <kind>=<weight> where kind is ping, discover, extdiscover or invalid\n");
+	fprintf(stderr, "    (default ping=1,discover=1)\n");
+	fprintf(stderr, "DISCOVER replies are rate limited by discoping: run it with a high -r value.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_port = htons(7655);
+	target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:d:r:s:m:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'H':
+			if (inet_aton(optarg, &target.sin_addr) == 0) {
+				fprintf(stderr, "Invalid address: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'p':
+			target.sin_port = htons((uint16_t)atoi(optarg));
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			if (duration < 1)
+				usage(argv[0]);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			socketCount = atoi(optarg);
+			if (socketCount < 1 || socketCount > MAX_SOCKETS) {
+				fprintf(stderr, "Number of sockets must be between 1 and %d\n", MAX_SOCKETS);
+				exit(1);
+			}
+			break;
+		case 'm':
+			parseMix(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+	buildSchedule();
+	samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+	if (samples == NULL)
+		error("malloc");
+	openSockets();
+
+	char host[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &target.sin_addr, host, sizeof(host));
+	printf("Sending to %s:%d from %d sockets for %d s", host, ntohs(target.sin_port), socketCount, duration);
+	if (rate != 0)
+		printf(" at %lu packets/s", rate);
+	printf("\n");
+
+	pthread_t receiver;
+	if (pthread_create(&receiver, NULL, receiverThread, NULL))
+		error("pthread_create");
+	sendLoop();
+	pthread_join(receiver, NULL);
+
+	uint64_t totalSent = 0;
+	for (int k = 0; k < KIND_COUNT; k++)
+		totalSent += sent[k];
+	uint64_t replies = pongs + discoReplies + extDiscoReplies;
+	printf("Sent:     %lu packets (%.0f/s): %lu ping, %lu discover, %lu extdiscover, %lu invalid, %lu send errors\n",
+			(unsigned long)totalSent, (double)totalSent / duration,
+			(unsigned long)sent[KIND_PING], (unsigned long)sent[KIND_DISCOVER], (unsigned long)sent[KIND_EXT_DISCOVER],
+			(unsigned long)sent[KIND_INVALID], (unsigned long)sendErrors);
+	printf("Replies:  %lu (%.0f/s): %lu pong (%.2f%% loss), %lu discover (%.2f%% loss), %lu extdiscover (%.2f%% loss), %lu unexpected\n",
+			(unsigned long)replies, (double)replies / duration,
+			(unsigned long)pongs, loss(sent[KIND_PING], pongs),
+			(unsigned long)discoReplies, loss(sent[KIND_DISCOVER], discoReplies),
+			(unsigned long)extDiscoReplies, loss(sent[KIND_EXT_DISCOVER], extDiscoReplies),
+			(unsigned long)unexpected);
+	qsort(samples, sampleCount, sizeof(uint32_t), compareSamples);
+	printf("Latency:  min %.1f us, p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+			percentile(0), percentile(50), percentile(90), percentile(99), percentile(99.9), percentile(100));
+
+	return 0;
+}
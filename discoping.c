@@ -15,6 +15,8 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#define _GNU_SOURCE
+#include "pingxdp.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -23,35 +25,235 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <libgen.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <ctype.h>
 #include <poll.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <linux/filter.h>
+#include <math.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <sys/time.h>
 
 const uint32_t MAGIC = 0xDC15C001;
 #define PING 1
 #define PONG 2
 #define DISCOVER 3
 #define DNS_TTL 3600
+#define MAX_NAME_LEN 15
+#define MAX_DISCO_SIZE 512
+#define BATCH_SIZE 64
+#define MAX_WORKERS 16
+#define LIMITER_SETS 1024
+#define LIMITER_WAYS 4
+// Access point probing, in milliseconds
+#define PROBE_INTERVAL 5000		// healthy access point
+#define FAST_PROBE_INTERVAL 1000	// after a loss or an RTT spike
+#define OFFLINE_PROBE_INTERVAL 5000
+#define MIN_PROBE_TIMEOUT 500
+#define MAX_PROBE_TIMEOUT 2000
+#define OFFLINE_LOSSES 3			// consecutive losses to go offline
+#define ONLINE_REPLIES 2			// consecutive replies to go back online
+#define HEALTHY_REPLIES 5			// consecutive replies to go back to normal probing
+#define RTT_SAMPLES 32
+// Load exchange. Access points that support it answer a PING ending with LOAD_VERSION, sent by another access point of the list,
+// with a PONG followed by their load report.
+#define LOAD_VERSION 1
+#define LOAD_REPORT_SIZE 7			// version, BBA sessions, dial-up sessions, capacity
+#define LOAD_TTL 30000				// milliseconds before a report is considered stale
+#define LOAD_UNKNOWN 255
+#define METRICS_BACKLOG 16
+#define METRICS_CLIENTS 4			// connections served at the same time
+#define METRICS_TIMEOUT 2000000		// microseconds
 
 uint16_t port = 7655;
 const char *accessPointsFile = "/etc/dcnet/accesspoints";
-int sockfd = -1;
-struct stat oldstat;
+// Socket used by the control thread to ping other access points
+int ctrlSock = -1;
+int inotifyFd = -1;
+const char *accessPointsName;
+// Interface where PINGs are answered by an XDP program
+const char *xdpInterface;
+// DISCOVER replies allowed per second and per source address, and burst size
+unsigned discoverRate = 5;
+unsigned discoverBurst = 20;
+// Maximum number of sessions of this access point
+unsigned capacity = 64;
+// Sessions currently open on this access point
+unsigned bbaSessions;
+unsigned dialupSessions;
 time_t lastRefresh;
+// Prometheus metrics are served on this port on the loopback interface, if set
+int metricsPort;
+int metricsSock = -1;
+// Metrics connections, served with non-blocking I/O so that slow clients don't delay the probes
+typedef struct {
+	int fd;				// -1 if unused
+	uint64_t deadline;
+	char request[1024];
+	size_t requestLen;
+	char *reply;		// NULL until the request has been read
+	size_t replyLen;
+	size_t sent;
+} MetricsClient;
+MetricsClient metricsClients[METRICS_CLIENTS];
+// Duration of the last access points file load and DNS resolution, in microseconds
+uint64_t refreshDuration;
+_Atomic uint64_t dnsDuration;
+_Atomic uint64_t dnsFailures;
 
 typedef struct {
-	char name[16];
+	char host[256];
+	char name[MAX_NAME_LEN + 1];
 	uint32_t externalIp;
 	uint32_t internalIp;
-	uint64_t lastPing;
-	int pingCount;
 	int offline;
+	// Probing state. All times are CLOCK_MONOTONIC microseconds.
+	struct {
+		uint64_t nextProbe;
+		uint64_t probeSent;		// outstanding probe, 0 if none
+		int extended;			// the outstanding probe is an extended ping
+		int lost;				// consecutive lost probes
+		int received;			// consecutive answered probes
+		double srtt;			// smoothed RTT
+		double rttvar;			// smoothed RTT deviation (jitter)
+		uint32_t samples[RTT_SAMPLES];
+		int sampleCount;
+		uint64_t probes;
+		uint64_t losses;
+	} probe;
+	// Load reported in the last extended pong
+	struct {
+		uint64_t updated;		// 0 if unknown
+		uint16_t bbaSessions;
+		uint16_t dialupSessions;
+		uint16_t capacity;
+		int legacy;				// doesn't answer extended pings
+		int extendedLost;		// an extended ping was lost while the load was unknown: try a plain one
+	} load;
+	// DISCOVER reply entry: external IP, name length, name
+	uint8_t discoEntry[sizeof(uint32_t) + 1 + MAX_NAME_LEN];
+	size_t discoEntryLen;
 } AccessPoint;
-AccessPoint accessPoints[16];
+AccessPoint *accessPoints;
 int apCount;
+// Incremented each time the access point list is reloaded
+unsigned apGeneration;
+// Open addressing hash index of access points by internal IP.
+// Each slot holds an access point index + 1, or 0 if empty.
+int *apIndex;
+unsigned apIndexBits;
+
+// State shared with the worker threads. A new snapshot is published whenever the access point list
+// or an online status changes. Snapshots are never modified once published.
+typedef struct {
+	// DISCOVER reply payload, sent after the 5-byte request header.
+	// Same order as the extended reply.
+	size_t discoReplyLen;
+	uint8_t discoReply[MAX_DISCO_SIZE - 5];
+	// Extended DISCOVER reply payload, sent after the 6-byte request header.
+	// Access points are sorted by load and each entry is: external IP, load in percent, name length, name
+	size_t discoExtReplyLen;
+	uint8_t discoExtReply[MAX_DISCO_SIZE - 6];
+	// Load report of this access point, sent after extended pongs
+	uint8_t loadReport[LOAD_REPORT_SIZE];
+	// Sorted internal IPs of the access points, the only ones that get the load report
+	int peerCount;
+	uint32_t peers[];
+} Snapshot;
+_Atomic(Snapshot *) snapshot;
+// Replaced snapshots, freed once no worker uses them anymore
+Snapshot **retired;
+int retiredCount;
+
+// Packet counters. Each set is updated by a single thread and read by the metrics endpoint.
+enum {
+	INVALID_LENGTH,
+	INVALID_MAGIC,
+	INVALID_OP,
+	INVALID_TIMESTAMP,
+	INVALID_SOURCE,
+	INVALID_REASON_COUNT
+};
+const char *invalidReasons[INVALID_REASON_COUNT] = { "length", "magic", "op", "timestamp", "source" };
+typedef struct {
+	_Atomic uint64_t received[DISCOVER + 1];	// by op
+	_Atomic uint64_t pongs;
+	_Atomic uint64_t discoReplies;
+	_Atomic uint64_t extDiscoReplies;
+	_Atomic uint64_t rateLimited;
+	_Atomic uint64_t invalid[INVALID_REASON_COUNT];
+	_Atomic uint64_t sendErrors;
+} Stats;
+// Counters of the control thread
+Stats ctrlStats;
+
+// Token bucket of a source address.
+// Tokens are in thousandths of a reply.
+typedef struct {
+	uint32_t ip;
+	uint32_t lastUsed;
+	uint32_t tokens;
+} Limiter;
+// DISCOVER rate limiting. Set-associative cache of the most recently seen source addresses.
+// Shared by the workers: SO_REUSEPORT hashes the source port too, so a source using
+// several ports reaches several workers.
+typedef struct {
+	pthread_spinlock_t lock;
+	Limiter ways[LIMITER_WAYS];
+} LimiterSet;
+LimiterSet limiterSets[LIMITER_SETS];
+
+// Each worker thread has its own socket bound to the service port (SO_REUSEPORT)
+// and receives and answers datagrams in batches.
+typedef struct {
+	pthread_t thread;
+	int sockfd;
+	// Snapshot being used by the worker, if any
+	_Atomic(Snapshot *) hazard;
+	uint32_t now;
+	struct {
+		struct mmsghdr msgs[BATCH_SIZE];
+		struct iovec iovs[BATCH_SIZE];
+		struct sockaddr_in addrs[BATCH_SIZE];
+		uint8_t data[BATCH_SIZE][64];
+	} recvBatch;
+	struct {
+		struct mmsghdr msgs[BATCH_SIZE];
+		struct iovec iovs[BATCH_SIZE][2];
+		uint8_t pongs[BATCH_SIZE][13];
+		unsigned count;
+	} replyBatch;
+	Stats stats;
+} Worker;
+Worker *workers;
+int workerCount;
+
+// DNS names are resolved by a separate thread so that a slow DNS server doesn't block the service.
+// Results are sent back to the main thread through a pipe.
+typedef struct {
+	unsigned generation;
+	int index;
+	uint32_t ip;
+} DnsResult;
+typedef struct {
+	unsigned generation;
+	int count;
+	int *indexes;
+	char (*hosts)[256];
+} DnsJob;
+pthread_mutex_t dnsMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dnsCond = PTHREAD_COND_INITIALIZER;
+DnsJob *dnsJob;
+int dnsPipe[2] = { -1, -1 };
 
 void error(const char *str)
 {
@@ -59,27 +261,190 @@ void error(const char *str)
   exit(1);
 }
 
+static uint32_t hashIp(uint32_t ip)
+{
+	return (ip * 2654435761u) >> (32 - apIndexBits);
+}
+
+static void buildIndex()
+{
+	free(apIndex);
+	apIndexBits = 4;
+	while ((1u << apIndexBits) < (unsigned)apCount * 2)
+		apIndexBits++;
+	apIndex = calloc(1u << apIndexBits, sizeof(int));
+	if (apIndex == NULL)
+		error("calloc");
+	uint32_t mask = (1u << apIndexBits) - 1;
+	for (int i = 0; i < apCount; i++)
+	{
+		uint32_t ip = accessPoints[i].internalIp;
+		if (ip == 0)
+			continue;
+		uint32_t slot = hashIp(ip);
+		// first entry wins if an internal IP is listed twice
+		while (apIndex[slot] != 0 && accessPoints[apIndex[slot] - 1].internalIp != ip)
+			slot = (slot + 1) & mask;
+		if (apIndex[slot] == 0)
+			apIndex[slot] = i + 1;
+	}
+}
+
+static AccessPoint *findAccessPoint(uint32_t internalIp)
+{
+	if (apIndex == NULL || internalIp == 0)
+		return NULL;
+	uint32_t mask = (1u << apIndexBits) - 1;
+	for (uint32_t slot = hashIp(internalIp); apIndex[slot] != 0; slot = (slot + 1) & mask)
+	{
+		AccessPoint *ap = &accessPoints[apIndex[slot] - 1];
+		if (ap->internalIp == internalIp)
+			return ap;
+	}
+	return NULL;
+}
+
+static void setName(AccessPoint *ap, const char *name)
+{
+	strncpy(ap->name, name, sizeof(ap->name) - 1);
+	size_t l = strlen(ap->name);
+	memcpy(&ap->discoEntry[0], &ap->externalIp, sizeof(uint32_t));
+	ap->discoEntry[4] = (uint8_t)l;
+	memcpy(&ap->discoEntry[5], ap->name, l);
+	ap->discoEntryLen = 5 + l;
+}
+
+static void setExternalIp(AccessPoint *ap, uint32_t ip)
+{
+	ap->externalIp = ip;
+	memcpy(&ap->discoEntry[0], &ap->externalIp, sizeof(uint32_t));
+}
+
+static void addAccessPoint(AccessPoint **list, int *count, int *capacity, const AccessPoint *ap)
+{
+	if (*count == *capacity)
+	{
+		int newCapacity = *capacity == 0 ? 16 : *capacity * 2;
+		AccessPoint *newList = realloc(*list, (size_t)newCapacity * sizeof(AccessPoint));
+		if (newList == NULL)
+			error("realloc");
+		*list = newList;
+		*capacity = newCapacity;
+	}
+	(*list)[(*count)++] = *ap;
+}
+
+// Load of an access point in percent of its capacity
+static uint8_t loadPercent(const AccessPoint *ap)
+{
+	if (ap->load.updated == 0 || ap->load.capacity == 0)
+		return LOAD_UNKNOWN;
+	unsigned sessions = (unsigned)ap->load.bbaSessions + ap->load.dialupSessions;
+	if (sessions >= ap->load.capacity)
+		return 100;
+	return (uint8_t)(sessions * 100 / ap->load.capacity);
+}
+
+// Only called by the thread owning the counter so there's no need for an atomic increment
+static void count(_Atomic uint64_t *counter)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
 static const char *getDate()
 {
+	static __thread char nowstr[26];
 	time_t now;
 	time(&now);
-	char *nowstr = ctime(&now);
+	ctime_r(&now, nowstr);
 	nowstr[strlen(nowstr) - 1] = '\0';
 	return nowstr;
 }
 
-void pong(struct sockaddr_in *addr, const uint8_t *data, size_t len)
+static uint64_t getTimeUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Add a reply to the batch. The address and data must stay valid until sendReplies() is called.
+static void queueReply(Worker *w, struct sockaddr_in *addr, const uint8_t *header, size_t headerLen, const uint8_t *payload, size_t payloadLen)
 {
-	uint8_t resp[13];
-	if (len != sizeof(resp)) {
+	unsigned i = w->replyBatch.count++;
+	w->replyBatch.iovs[i][0].iov_base = (void *)header;
+	w->replyBatch.iovs[i][0].iov_len = headerLen;
+	w->replyBatch.iovs[i][1].iov_base = (void *)payload;
+	w->replyBatch.iovs[i][1].iov_len = payloadLen;
+	struct msghdr *msg = &w->replyBatch.msgs[i].msg_hdr;
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = addr;
+	msg->msg_namelen = sizeof(struct sockaddr_in);
+	msg->msg_iov = w->replyBatch.iovs[i];
+	msg->msg_iovlen = payloadLen > 0 ? 2 : 1;
+}
+
+void sendReplies(Worker *w)
+{
+	unsigned sent = 0;
+	while (sent < w->replyBatch.count)
+	{
+		int rc = sendmmsg(w->sockfd, &w->replyBatch.msgs[sent], w->replyBatch.count - sent, 0);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("ERROR: sendmmsg");
+			count(&w->stats.sendErrors);
+			// skip the failing datagram
+			rc = 1;
+		}
+		sent += (unsigned)rc;
+	}
+	w->replyBatch.count = 0;
+}
+
+static int isPeer(const Snapshot *snap, uint32_t ip)
+{
+	int low = 0;
+	int high = snap->peerCount - 1;
+	while (low <= high)
+	{
+		int mid = (low + high) / 2;
+		if (snap->peers[mid] == ip)
+			return 1;
+		if (snap->peers[mid] < ip)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return 0;
+}
+
+static int compareIp(const void *a, const void *b)
+{
+	uint32_t ipa = *(const uint32_t *)a;
+	uint32_t ipb = *(const uint32_t *)b;
+	return ipa < ipb ? -1 : ipa > ipb;
+}
+
+void pong(Worker *w, const Snapshot *snap, struct sockaddr_in *addr, const uint8_t *data, size_t len)
+{
+	size_t pingLen = sizeof(w->replyBatch.pongs[0]);
+	if (len != pingLen && (len != pingLen + 1 || data[pingLen] != LOAD_VERSION)) {
 		fprintf(stderr, "Invalid ping packet received: len %zd\n", len);
+		count(&w->stats.invalid[INVALID_LENGTH]);
 		return;
 	}
-	memcpy(resp, data, sizeof(resp));
+	uint8_t *resp = w->replyBatch.pongs[w->replyBatch.count];
+	memcpy(resp, data, pingLen);
 	resp[4] = PONG;
-	ssize_t sent = sendto(sockfd, resp, sizeof(resp), 0, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
-    if (sent < 0)
-      perror("ERROR: sendto");
+	count(&w->stats.pongs);
+	// Extended pings get a larger reply, so only other access points can get it
+	if (len == pingLen || !isPeer(snap, addr->sin_addr.s_addr))
+		queueReply(w, addr, resp, pingLen, NULL, 0);
+	else
+		queueReply(w, addr, resp, pingLen, snap->loadReport, sizeof(snap->loadReport));
 }
 
 uint32_t resolve(const char *servname)
@@ -107,30 +472,222 @@ uint32_t resolve(const char *servname)
 	return ipaddr;
 }
 
-void refresh()
+// Free the retired snapshots that aren't used by any worker
+static void reclaimSnapshots()
 {
-	struct stat newstat;
-	if (stat(accessPointsFile, &newstat)) {
-		perror(accessPointsFile);
-		return;
+	int kept = 0;
+	for (int i = 0; i < retiredCount; i++)
+	{
+		int inUse = 0;
+		for (int j = 0; j < workerCount && !inUse; j++)
+			inUse = atomic_load(&workers[j].hazard) == retired[i];
+		if (inUse)
+			retired[kept++] = retired[i];
+		else
+			free(retired[i]);
 	}
-	if (memcmp(&oldstat.st_mtim, &newstat.st_mtim, sizeof(oldstat.st_mtim))) {
-		// Force refresh if access points file has changed
-		lastRefresh = 0;
-		memcpy(&oldstat.st_mtim, &newstat.st_mtim, sizeof(oldstat.st_mtim));
+	retiredCount = kept;
+}
+
+// Build a new snapshot from the access point list and make it visible to the workers
+void publishSnapshot()
+{
+	Snapshot *snap = malloc(sizeof(Snapshot) + (size_t)apCount * sizeof(uint32_t));
+	if (snap == NULL)
+		error("malloc");
+	// Least loaded access points first, unknown loads last, file order otherwise
+	struct { uint8_t load; int index; } *order = malloc(((size_t)apCount + 1) * sizeof(*order));
+	if (order == NULL)
+		error("malloc");
+	int count = 0;
+	for (int i = 0; i < apCount; i++)
+	{
+		if (accessPoints[i].offline || accessPoints[i].externalIp == 0)
+			continue;
+		uint8_t load = loadPercent(&accessPoints[i]);
+		// insertion sort, the list is short
+		int j = count - 1;
+		for (; j >= 0 && order[j].load > load; j--)
+			order[j + 1] = order[j];
+		order[j + 1].load = load;
+		order[j + 1].index = i;
+		count++;
 	}
-	time_t now = time(NULL);
-	if (now - lastRefresh < DNS_TTL)
-		return;
+	// Older clients take the first access point that answers their pings
+	uint8_t *p = &snap->discoReply[0];
+	for (int i = 0; i < count; i++)
+	{
+		AccessPoint *ap = &accessPoints[order[i].index];
+		if (p + ap->discoEntryLen > snap->discoReply + sizeof(snap->discoReply)) {
+			fprintf(stderr, "[%s] DISCOVER reply full: access point \"%s\" and the ones after it are not advertised\n", getDate(), ap->name);
+			break;
+		}
+		memcpy(p, ap->discoEntry, ap->discoEntryLen);
+		p += ap->discoEntryLen;
+	}
+	snap->discoReplyLen = (size_t)(p - snap->discoReply);
+
+	// Extended reply: the load follows the IP address of each entry
+	p = &snap->discoExtReply[0];
+	for (int i = 0; i < count; i++)
+	{
+		AccessPoint *ap = &accessPoints[order[i].index];
+		if (p + ap->discoEntryLen + 1 > snap->discoExtReply + sizeof(snap->discoExtReply))
+			break;
+		memcpy(p, ap->discoEntry, 4);
+		p[4] = order[i].load;
+		memcpy(p + 5, ap->discoEntry + 4, ap->discoEntryLen - 4);
+		p += ap->discoEntryLen + 1;
+	}
+	snap->discoExtReplyLen = (size_t)(p - snap->discoExtReply);
+	free(order);
 
-	lastRefresh = now;
+	snap->peerCount = 0;
+	for (int i = 0; i < apCount; i++)
+		if (accessPoints[i].internalIp != 0)
+			snap->peers[snap->peerCount++] = accessPoints[i].internalIp;
+	qsort(snap->peers, (size_t)snap->peerCount, sizeof(uint32_t), compareIp);
+
+	snap->loadReport[0] = LOAD_VERSION;
+	uint16_t v = htons((uint16_t)bbaSessions);
+	memcpy(&snap->loadReport[1], &v, sizeof(v));
+	v = htons((uint16_t)dialupSessions);
+	memcpy(&snap->loadReport[3], &v, sizeof(v));
+	v = htons((uint16_t)capacity);
+	memcpy(&snap->loadReport[5], &v, sizeof(v));
+
+	Snapshot *old = atomic_exchange(&snapshot, snap);
+	if (old != NULL)
+	{
+		Snapshot **newRetired = realloc(retired, (size_t)(retiredCount + 1) * sizeof(Snapshot *));
+		if (newRetired == NULL)
+			error("realloc");
+		retired = newRetired;
+		retired[retiredCount++] = old;
+	}
+	reclaimSnapshots();
+	// Follow the address changes of the XDP interface
+	pingXdpRefresh();
+}
+
+void *dnsThread(void *arg)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&dnsMutex);
+		while (dnsJob == NULL)
+			pthread_cond_wait(&dnsCond, &dnsMutex);
+		DnsJob *job = dnsJob;
+		dnsJob = NULL;
+		pthread_mutex_unlock(&dnsMutex);
+
+		uint64_t start = getTimeUs();
+		for (int i = 0; i < job->count; i++)
+		{
+			DnsResult result;
+			result.generation = job->generation;
+			result.index = job->indexes[i];
+			result.ip = resolve(job->hosts[i]);
+			if (result.ip == 0) {
+				// keep the previous address
+				atomic_fetch_add_explicit(&dnsFailures, 1, memory_order_relaxed);
+				continue;
+			}
+			if (write(dnsPipe[1], &result, sizeof(result)) != sizeof(result))
+				perror("ERROR: write(dns pipe)");
+		}
+		atomic_store_explicit(&dnsDuration, getTimeUs() - start, memory_order_relaxed);
+		free(job->indexes);
+		free(job->hosts);
+		free(job);
+	}
+	return NULL;
+}
+
+void startDnsThread()
+{
+	if (pipe2(dnsPipe, O_CLOEXEC | O_NONBLOCK))
+		error("ERROR: pipe");
+	// the resolver thread can block on write
+	fcntl(dnsPipe[1], F_SETFL, 0);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, dnsThread, NULL))
+		error("ERROR: pthread_create");
+	pthread_detach(thread);
+}
+
+// Queue all the DNS names of the current list for resolution.
+// A job that hasn't started yet is replaced.
+void resolveAccessPoints()
+{
+	DnsJob *job = calloc(1, sizeof(DnsJob));
+	if (job == NULL)
+		error("calloc");
+	job->generation = apGeneration;
+	job->indexes = calloc((size_t)apCount + 1, sizeof(int));
+	job->hosts = calloc((size_t)apCount + 1, sizeof(job->hosts[0]));
+	if (job->indexes == NULL || job->hosts == NULL)
+		error("calloc");
+	for (int i = 0; i < apCount; i++)
+	{
+		struct in_addr addr;
+		if (inet_aton(accessPoints[i].host, &addr))
+			continue;
+		job->indexes[job->count] = i;
+		memcpy(job->hosts[job->count], accessPoints[i].host, sizeof(job->hosts[0]));
+		job->count++;
+	}
+	pthread_mutex_lock(&dnsMutex);
+	DnsJob *oldJob = dnsJob;
+	dnsJob = job;
+	pthread_cond_signal(&dnsCond);
+	pthread_mutex_unlock(&dnsMutex);
+	if (oldJob != NULL) {
+		free(oldJob->indexes);
+		free(oldJob->hosts);
+		free(oldJob);
+	}
+}
+
+// Apply the addresses resolved by the DNS thread
+void dnsResults()
+{
+	int changed = 0;
+	DnsResult result;
+	while (read(dnsPipe[0], &result, sizeof(result)) == sizeof(result))
+	{
+		if (result.generation != apGeneration || result.index >= apCount)
+			// the list has been reloaded since
+			continue;
+		AccessPoint *ap = &accessPoints[result.index];
+		if (ap->externalIp != result.ip) {
+			setExternalIp(ap, result.ip);
+			changed = 1;
+		}
+	}
+	if (changed)
+		publishSnapshot();
+}
+
+// Find the address of a host in the current list, so it stays available while the new list is being resolved
+static uint32_t previousIp(const char *host)
+{
+	for (int i = 0; i < apCount; i++)
+		if (!strcmp(accessPoints[i].host, host))
+			return accessPoints[i].externalIp;
+	return 0;
+}
+
+void loadAccessPoints()
+{
 	FILE *f = fopen(accessPointsFile, "r");
 	if (f == NULL) {
 		perror(accessPointsFile);
 		return;
 	}
-	apCount = 0;
-	memset(accessPoints, 0, sizeof(accessPoints));
+	AccessPoint *list = NULL;
+	int count = 0;
+	int capacity = 0;
 	// File format:
 	// <DNS name or external IP address> [<access point name> [<internal IP address>]]
 	// Access point name defaults to the DNS name/external address.
@@ -159,15 +716,18 @@ void refresh()
 			p++;
 		while (isblank(*p))
 			*p++ = '\0';
-		AccessPoint *ap = &accessPoints[apCount];
-		ap->externalIp = resolve(dnsName);
-		if (ap->externalIp == 0)
-			continue;
+		AccessPoint ap;
+		memset(&ap, 0, sizeof(ap));
+		strncpy(ap.host, dnsName, sizeof(ap.host) - 1);
+		struct in_addr extaddr;
+		if (inet_aton(dnsName, &extaddr))
+			ap.externalIp = extaddr.s_addr;
+		else
+			ap.externalIp = previousIp(dnsName);
 		if (*p == '\0') {
 			// ip/dns_name only
-			strncpy(ap->name, dnsName, sizeof(ap->name) - 1);
-			ap->internalIp = 0;
-			apCount++;
+			setName(&ap, dnsName);
+			addAccessPoint(&list, &count, &capacity, &ap);
 			continue;
 		}
 		const char *name = NULL;
@@ -188,201 +748,942 @@ void refresh()
 		}
 		while (isblank(*p))
 			*p++ = '\0';
-		strncpy(ap->name, name, sizeof(ap->name) - 1);
-		if (*p == '\0') {
-			ap->internalIp = 0;
-		}
-		else {
+		setName(&ap, name);
+		if (*p != '\0')
+		{
 			struct in_addr apaddr;
 			if (inet_aton(p, &apaddr) == 0) {
 				fprintf(stderr, "%d: Invalid internal IP address: %s\n", lineNum, p);
 				continue;
 			}
-			ap->internalIp = apaddr.s_addr;
+			ap.internalIp = apaddr.s_addr;
+			// keep the probing state of the previous list
+			AccessPoint *old = findAccessPoint(ap.internalIp);
+			if (old != NULL) {
+				ap.offline = old->offline;
+				ap.probe = old->probe;
+				ap.load = old->load;
+			}
 		}
-		apCount++;
+		addAccessPoint(&list, &count, &capacity, &ap);
 	}
 	fclose(f);
+	free(accessPoints);
+	accessPoints = list;
+	apCount = count;
+	apGeneration++;
+	buildIndex();
+	publishSnapshot();
 }
 
-void disco(struct sockaddr_in *addr, const uint8_t *data, size_t len)
+void refresh()
 {
-	refresh();
-	uint8_t resp[512];
-	memcpy(&resp[0], data, 5);
-	uint8_t *p = &resp[5];
-	for (int i = 0; i < apCount; i++)
+	uint64_t start = getTimeUs();
+	loadAccessPoints();
+	refreshDuration = getTimeUs() - start;
+	lastRefresh = time(NULL);
+	resolveAccessPoints();
+}
+
+// Watch the directory of the access points file so that it's also
+// seen when replaced by rename (editors, package managers)
+void watchAccessPoints()
+{
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0)
+		error("ERROR: inotify_init");
+	char *path = strdup(accessPointsFile);
+	char *name = strdup(accessPointsFile);
+	if (path == NULL || name == NULL)
+		error("strdup");
+	accessPointsName = basename(name);
+	if (inotify_add_watch(inotifyFd, dirname(path), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		perror(accessPointsFile);
+	free(path);
+}
+
+// Reload the access points if the file has been modified
+void inotifyEvents()
+{
+	int changed = 0;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(inotifyFd, buf, sizeof(buf))) > 0)
 	{
-		AccessPoint *ap = &accessPoints[i];
-		if (ap->offline)
-			continue;
-		memcpy(p, &ap->externalIp, sizeof(uint32_t));
-		p += sizeof(uint32_t);
-		size_t l = strlen(ap->name);
-		*p++ = (uint8_t)l;
-		memcpy(p, ap->name, l);
-		p += l;
+		for (char *p = buf; p < buf + len; )
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+			if (event->len > 0 && !strcmp(event->name, accessPointsName))
+				changed = 1;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	if (changed) {
+		printf("[%s] %s has changed. Reloading\n", getDate(), accessPointsFile);
+		refresh();
+	}
+}
+
+// Returns 1 if a DISCOVER from this address can be answered.
+// Replies are much larger than requests so they must not be sent to spoofed addresses at will.
+static int allowDiscover(Worker *w, uint32_t ip)
+{
+	LimiterSet *set = &limiterSets[(ip * 2654435761u) >> 22];
+	pthread_spin_lock(&set->lock);
+	Limiter *limiter = NULL;
+	Limiter *oldest = &set->ways[0];
+	for (int i = 0; i < LIMITER_WAYS; i++)
+	{
+		if (set->ways[i].ip == ip && set->ways[i].lastUsed != 0) {
+			limiter = &set->ways[i];
+			break;
+		}
+		if (w->now - set->ways[i].lastUsed > w->now - oldest->lastUsed)
+			oldest = &set->ways[i];
+	}
+	if (limiter == NULL)
+	{
+		// evict the least recently used address of the set
+		limiter = oldest;
+		limiter->ip = ip;
+		limiter->tokens = discoverBurst * 1000;
+		limiter->lastUsed = w->now;
+	}
+	else
+	{
+		uint32_t elapsed = w->now - limiter->lastUsed;
+		// Another worker may have used a slightly more recent time
+		if (elapsed <= INT32_MAX)
+		{
+			uint64_t tokens = limiter->tokens + (uint64_t)elapsed * discoverRate;
+			limiter->tokens = tokens > discoverBurst * 1000 ? discoverBurst * 1000 : (uint32_t)tokens;
+			limiter->lastUsed = w->now;
+		}
 	}
-	ssize_t sent = sendto(sockfd, resp, (size_t)(p - resp), 0, (struct sockaddr *)addr, sizeof(struct sockaddr_in));
-    if (sent < 0)
-      perror("ERROR: disco sendto");
+	int allowed = limiter->tokens >= 1000;
+	if (allowed)
+		limiter->tokens -= 1000;
+	pthread_spin_unlock(&set->lock);
+	return allowed;
 }
 
-int pingAccessPoints(int sockfd, int force)
+void disco(Worker *w, const Snapshot *snap, struct sockaddr_in *addr, const uint8_t *data, size_t len)
 {
-	int pingSent = 0;
-	struct timespec tsnow;
-	clock_gettime(CLOCK_REALTIME, &tsnow);
-	uint64_t now = (uint64_t)tsnow.tv_sec * 1000 + (uint64_t)tsnow.tv_nsec / 1000000;
+	if (!allowDiscover(w, addr->sin_addr.s_addr)) {
+		count(&w->stats.rateLimited);
+		return;
+	}
+	if (len >= 6 && data[5] == LOAD_VERSION) {
+		queueReply(w, addr, data, 6, snap->discoExtReply, snap->discoExtReplyLen);
+		count(&w->stats.extDiscoReplies);
+	}
+	else {
+		queueReply(w, addr, data, 5, snap->discoReply, snap->discoReplyLen);
+		count(&w->stats.discoReplies);
+	}
+}
+
+// RTT percentile of the last samples, in microseconds
+static uint32_t rttPercentile(const AccessPoint *ap, int percent)
+{
+	int count = ap->probe.sampleCount < RTT_SAMPLES ? ap->probe.sampleCount : RTT_SAMPLES;
+	if (count == 0)
+		return 0;
+	uint32_t sorted[RTT_SAMPLES];
+	memcpy(sorted, ap->probe.samples, (size_t)count * sizeof(uint32_t));
+	// insertion sort
+	for (int i = 1; i < count; i++)
+	{
+		uint32_t v = sorted[i];
+		int j = i - 1;
+		for (; j >= 0 && sorted[j] > v; j--)
+			sorted[j + 1] = sorted[j];
+		sorted[j + 1] = v;
+	}
+	return sorted[(count - 1) * percent / 100];
+}
+
+static void logProbeStats(const AccessPoint *ap, const char *state)
+{
+	fprintf(stderr, "[%s] Access point \"%s\" is %s (rtt %.1f ms, jitter %.1f ms, p50 %.1f ms, p95 %.1f ms, %lu/%lu probes lost)\n",
+			getDate(), ap->name, state, ap->probe.srtt / 1000.0, ap->probe.rttvar / 1000.0,
+			rttPercentile(ap, 50) / 1000.0, rttPercentile(ap, 95) / 1000.0,
+			(unsigned long)ap->probe.losses, (unsigned long)ap->probe.probes);
+}
+
+// Wait longer than usual for slow access points, but not too long to detect failures quickly
+static uint64_t probeTimeout(const AccessPoint *ap)
+{
+	double timeout = ap->probe.sampleCount == 0 ? MAX_PROBE_TIMEOUT * 1000.0 : ap->probe.srtt + 4 * ap->probe.rttvar;
+	if (timeout < MIN_PROBE_TIMEOUT * 1000.0)
+		timeout = MIN_PROBE_TIMEOUT * 1000.0;
+	if (timeout > MAX_PROBE_TIMEOUT * 1000.0)
+		timeout = MAX_PROBE_TIMEOUT * 1000.0;
+	return (uint64_t)timeout;
+}
+
+static uint64_t probeInterval(const AccessPoint *ap)
+{
+	if (ap->offline)
+		return OFFLINE_PROBE_INTERVAL * 1000;
+	if (ap->probe.lost > 0 || ap->probe.received < HEALTHY_REPLIES)
+		return FAST_PROBE_INTERVAL * 1000;
+	return PROBE_INTERVAL * 1000;
+}
+
+// Count the sessions of this access point: tap interfaces are BBA sessions created by ethtap
+// and ppp interfaces are dial-up sessions.
+// Returns 1 if the counts have changed.
+static int updateLocalLoad()
+{
+	static uint64_t nextUpdate;
+	uint64_t now = getTimeUs();
+	if (now < nextUpdate)
+		return 0;
+	nextUpdate = now + 1000000;
+	DIR *dir = opendir("/sys/class/net");
+	if (dir == NULL)
+		return 0;
+	unsigned bba = 0;
+	unsigned dialup = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (!strncmp(entry->d_name, "tap", 3))
+			bba++;
+		else if (!strncmp(entry->d_name, "ppp", 3))
+			dialup++;
+	}
+	closedir(dir);
+	if (bba == bbaSessions && dialup == dialupSessions)
+		return 0;
+	bbaSessions = bba;
+	dialupSessions = dialup;
+	return 1;
+}
+
+// Send the probes that are due and detect lost ones.
+// Returns the time of the next probe event.
+uint64_t probeAccessPoints(int sockfd)
+{
+	uint64_t now = getTimeUs();
+	uint64_t nextEvent = now + PROBE_INTERVAL * 1000;
+	int changed = 0;
 	for (int i = 0; i < apCount; i++)
 	{
 		AccessPoint *ap = &accessPoints[i];
 		if (ap->internalIp == 0)
 			continue;
-		if (force) {
-			ap->pingCount = 0;
+		if (ap->probe.probeSent != 0 && now >= ap->probe.probeSent + probeTimeout(ap)
+				&& ap->probe.extended && ap->load.legacy)
+		{
+			// Older versions drop extended pings: the occasional retry isn't counted as a loss
+			ap->probe.probeSent = 0;
+			ap->probe.nextProbe = now;
 		}
-		else
+		if (ap->probe.probeSent != 0 && now >= ap->probe.probeSent + probeTimeout(ap))
 		{
-			if (ap->lastPing == 0 || ap->lastPing + 5000 > now)
-				continue;
-			if (ap->pingCount == 5)
-			{
-				if (ap->offline == 0)
-					fprintf(stderr, "[%s] Access point \"%s\" is offline\n", getDate(), ap->name);
+			// probe lost. If the load is unknown, the access point may be an older version
+			// that drops extended pings: a lost extended probe is followed by a plain one to find out.
+			if (ap->load.updated == 0)
+				ap->load.extendedLost = ap->probe.extended;
+			ap->probe.probeSent = 0;
+			ap->probe.lost++;
+			ap->probe.received = 0;
+			ap->probe.losses++;
+			if (!ap->offline && ap->probe.lost >= OFFLINE_LOSSES) {
 				ap->offline = 1;
-				continue;
+				logProbeStats(ap, "offline");
+				changed = 1;
 			}
-			ap->pingCount++;
+			ap->probe.nextProbe = ap->offline ? now + probeInterval(ap) : now;
 		}
-		uint8_t payload[sizeof(MAGIC) + 1 + sizeof(uint64_t)];
-		memcpy(payload, &MAGIC, sizeof(MAGIC));
-		payload[4] = PING;
-		ap->lastPing = now;
-		memcpy(payload + 5, &ap->lastPing, sizeof(uint64_t));
+		if (ap->load.updated != 0 && now - ap->load.updated >= LOAD_TTL * 1000) {
+			ap->load.updated = 0;
+			changed = 1;
+		}
+		if (ap->probe.probeSent == 0 && now >= ap->probe.nextProbe)
+		{
+			// Extended ping to get the load of the access point.
+			// Try again from time to time if it wasn't supported, in case it has been upgraded.
+			ap->probe.extended = !ap->load.extendedLost && (!ap->load.legacy || ap->probe.probes % 64 == 0);
+			uint8_t payload[sizeof(MAGIC) + 1 + sizeof(uint64_t) + 1];
+			memcpy(payload, &MAGIC, sizeof(MAGIC));
+			payload[4] = PING;
+			memcpy(payload + 5, &now, sizeof(uint64_t));
+			payload[13] = LOAD_VERSION;
 
-		pingSent++;
-		struct sockaddr_in apAddr;
-		apAddr.sin_family = AF_INET;
-		apAddr.sin_port = htons(port);
-		apAddr.sin_addr.s_addr = ap->internalIp;
-		ssize_t sent = sendto(sockfd, payload, sizeof(payload), 0, (struct sockaddr *)&apAddr, sizeof(apAddr));
-	    if (sent < 0)
-	      perror("ERROR: ping sendto");
+			struct sockaddr_in apAddr;
+			apAddr.sin_family = AF_INET;
+			apAddr.sin_port = htons(port);
+			apAddr.sin_addr.s_addr = ap->internalIp;
+			size_t size = ap->probe.extended ? sizeof(payload) : sizeof(payload) - 1;
+			ssize_t sent = sendto(sockfd, payload, size, 0, (struct sockaddr *)&apAddr, sizeof(apAddr));
+			if (sent < 0)
+			{
+				perror("ERROR: ping sendto");
+				count(&ctrlStats.sendErrors);
+			}
+			ap->probe.probeSent = now;
+			ap->probe.probes++;
+		}
+		uint64_t next = ap->probe.probeSent != 0 ? ap->probe.probeSent + probeTimeout(ap) : ap->probe.nextProbe;
+		if (next < nextEvent)
+			nextEvent = next;
 	}
-	return pingSent;
+	if (updateLocalLoad())
+		changed = 1;
+	if (changed)
+		publishSnapshot();
+	return nextEvent;
 }
 
 void apPong(struct sockaddr_in *addr, const uint8_t *data, size_t len)
 {
-	if (len != 13) {
+	// access points running an older version don't send their load
+	if (len != 13 && (len != 13 + LOAD_REPORT_SIZE || data[13] != LOAD_VERSION)) {
 		fprintf(stderr, "Invalid pong packet received: len %zd\n", len);
+		count(&ctrlStats.invalid[INVALID_LENGTH]);
 		return;
 	}
-	for (int i = 0; i < apCount; i++)
+	AccessPoint *ap = findAccessPoint(addr->sin_addr.s_addr);
+	if (ap != NULL)
 	{
-		AccessPoint *ap = &accessPoints[i];
-		if (ap->internalIp != addr->sin_addr.s_addr)
-			continue;
-		ap->lastPing = 0;
-		ap->pingCount = 0;
-		if (ap->offline == 1)
-			fprintf(stderr, "[%s] Access point \"%s\" is back online\n", getDate(), ap->name);
-		ap->offline = 0;
+		uint64_t now = getTimeUs();
+		uint64_t stamp;
+		memcpy(&stamp, data + 5, sizeof(stamp));
+		if (ap->probe.probeSent == 0 || stamp != ap->probe.probeSent) {
+			// Late answer to a probe already counted as lost, or forged
+			count(&ctrlStats.invalid[INVALID_TIMESTAMP]);
+			return;
+		}
+		ap->probe.probeSent = 0;
+		ap->probe.nextProbe = now;	// updated below
+		double rtt = (double)(now - stamp);
+		if (ap->probe.sampleCount == 0) {
+			ap->probe.srtt = rtt;
+			ap->probe.rttvar = rtt / 2;
+		}
+		else
+		{
+			// RTT spike: probe faster until it settles
+			if (rtt > ap->probe.srtt + 4 * ap->probe.rttvar && rtt > 2 * ap->probe.srtt)
+				ap->probe.received = 0;
+			ap->probe.rttvar = 0.75 * ap->probe.rttvar + 0.25 * fabs(ap->probe.srtt - rtt);
+			ap->probe.srtt = 0.875 * ap->probe.srtt + 0.125 * rtt;
+		}
+		ap->probe.samples[ap->probe.sampleCount % RTT_SAMPLES] = (uint32_t)rtt;
+		ap->probe.sampleCount++;
+		ap->probe.lost = 0;
+		ap->probe.received++;
+		int changed = 0;
+		if (len == 13 + LOAD_REPORT_SIZE)
+		{
+			uint8_t oldLoad = loadPercent(ap);
+			uint16_t v;
+			memcpy(&v, &data[14], sizeof(v));
+			ap->load.bbaSessions = ntohs(v);
+			memcpy(&v, &data[16], sizeof(v));
+			ap->load.dialupSessions = ntohs(v);
+			memcpy(&v, &data[18], sizeof(v));
+			ap->load.capacity = ntohs(v);
+			ap->load.updated = now;
+			ap->load.legacy = 0;
+			ap->load.extendedLost = 0;
+			changed = loadPercent(ap) != oldLoad;
+		}
+		else if (ap->load.extendedLost)
+		{
+			// Answers plain pings only
+			ap->load.legacy = 1;
+			ap->load.extendedLost = 0;
+		}
+		if (ap->offline && ap->probe.received >= ONLINE_REPLIES) {
+			ap->offline = 0;
+			logProbeStats(ap, "back online");
+			changed = 1;
+		}
+		if (changed)
+			publishSnapshot();
+		if (ap->probe.nextProbe <= now)
+			ap->probe.nextProbe = now + probeInterval(ap);
 		return;
 	}
 	char ip[INET_ADDRSTRLEN];
 	inet_ntop(AF_INET, &addr->sin_addr, ip, INET_ADDRSTRLEN);
 	fprintf(stderr, "Pong message from unexpected address: %s\n", ip);
+	count(&ctrlStats.invalid[INVALID_SOURCE]);
+}
+
+static int checkPacket(Stats *stats, const uint8_t *data, size_t len)
+{
+	if (len < 5) {
+		fprintf(stderr, "Invalid packet received: len %zd\n", len);
+		count(&stats->invalid[INVALID_LENGTH]);
+		return 0;
+	}
+	if (memcmp(&MAGIC, data, sizeof(MAGIC))) {
+		fprintf(stderr, "Invalid packet received: bad magic\n");
+		count(&stats->invalid[INVALID_MAGIC]);
+		return 0;
+	}
+	if (data[4] != PING && data[4] != PONG && data[4] != DISCOVER) {
+		fprintf(stderr, "Invalid packet received: bad op\n");
+		count(&stats->invalid[INVALID_OP]);
+		return 0;
+	}
+	count(&stats->received[data[4]]);
+	return 1;
+}
+
+void handlePacket(Worker *w, const Snapshot *snap, struct sockaddr_in *srcAddr, const uint8_t *data, size_t len)
+{
+	if (!checkPacket(&w->stats, data, len))
+		return;
+	switch (data[4])
+	{
+	case PING:
+		pong(w, snap, srcAddr, data, len);
+		break;
+	case DISCOVER:
+		disco(w, snap, srcAddr, data, len);
+		break;
+	default:
+		// pongs are received by the control socket
+		fprintf(stderr, "Invalid packet received: bad op\n");
+		count(&w->stats.invalid[INVALID_OP]);
+		break;
+	}
+}
+
+// Receive datagrams in batches and answer each batch with a single sendmmsg()
+void *workerThread(void *arg)
+{
+	Worker *w = (Worker *)arg;
+	for (;;)
+	{
+		for (int i = 0; i < BATCH_SIZE; i++)
+		{
+			w->recvBatch.iovs[i].iov_base = w->recvBatch.data[i];
+			w->recvBatch.iovs[i].iov_len = sizeof(w->recvBatch.data[i]);
+			struct msghdr *msg = &w->recvBatch.msgs[i].msg_hdr;
+			memset(msg, 0, sizeof(*msg));
+			msg->msg_name = &w->recvBatch.addrs[i];
+			msg->msg_namelen = sizeof(w->recvBatch.addrs[i]);
+			msg->msg_iov = &w->recvBatch.iovs[i];
+			msg->msg_iovlen = 1;
+		}
+		int count = recvmmsg(w->sockfd, w->recvBatch.msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("ERROR: recvmmsg");
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		// milliseconds, never 0
+		w->now = (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000) | 1;
+		// Protect the current snapshot from being freed until the replies are sent
+		Snapshot *snap;
+		do {
+			snap = atomic_load(&snapshot);
+			atomic_store(&w->hazard, snap);
+		} while (snap != atomic_load(&snapshot));
+
+		for (int i = 0; i < count; i++)
+			handlePacket(w, snap, &w->recvBatch.addrs[i], w->recvBatch.data[i], w->recvBatch.msgs[i].msg_len);
+		sendReplies(w);
+		atomic_store(&w->hazard, NULL);
+	}
+	return NULL;
+}
+
+// Drop datagrams that can't be valid requests before they reach user space
+void attachFilter(int sockfd)
+{
+	// UDP sockets filters see the UDP header followed by the payload
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 8 + 5, 0, 13),				// too short
+		BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, 8 + 64, 12, 0),				// too long
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(MAGIC), 0, 10),		// bad magic
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8 + 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, DISCOVER, 9, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PING, 4, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PONG, 0, 6),				// bad op
+		// pong, with or without load report
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 8 + 13, 5, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 8 + 13 + LOAD_REPORT_SIZE, 4, 3),
+		// ping, regular or extended
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 8 + 13, 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 8 + 14, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),									// drop
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),								// accept
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		perror("setsockopt(SO_ATTACH_FILTER)");
+}
+
+void startWorkers()
+{
+	for (int i = 0; i < LIMITER_SETS; i++)
+		pthread_spin_init(&limiterSets[i].lock, PTHREAD_PROCESS_PRIVATE);
+	workers = calloc((size_t)workerCount, sizeof(Worker));
+	if (workers == NULL)
+		error("calloc");
+	for (int i = 0; i < workerCount; i++)
+	{
+		Worker *w = &workers[i];
+		w->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+		if (w->sockfd < 0)
+			error("ERROR opening socket");
+		attachFilter(w->sockfd);
+		int optval = 1;
+		setsockopt(w->sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+		if (setsockopt(w->sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)))
+			error("ERROR: setsockopt(SO_REUSEPORT)");
+		struct sockaddr_in serveraddr;
+		serveraddr.sin_family = AF_INET;
+		serveraddr.sin_port = htons(port);
+		serveraddr.sin_addr.s_addr = INADDR_ANY;
+		if (bind(w->sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0)
+			error("ERROR: bind");
+		if (pthread_create(&w->thread, NULL, workerThread, w))
+			error("ERROR: pthread_create");
+	}
+}
+
+// Receive the pongs from other access points
+void ctrlPackets()
+{
+	for (;;)
+	{
+		struct sockaddr_in srcAddr;
+		socklen_t addrlen = sizeof(srcAddr);
+		uint8_t data[64];
+		ssize_t len = recvfrom(ctrlSock, data, sizeof(data), MSG_DONTWAIT, (struct sockaddr *)&srcAddr, &addrlen);
+		if (len < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			error("ERROR: recvfrom");
+		}
+		if (!checkPacket(&ctrlStats, data, (size_t)len))
+			continue;
+		if (data[4] == PONG)
+			apPong(&srcAddr, data, (size_t)len);
+		else {
+			fprintf(stderr, "Invalid packet received: bad op\n");
+			count(&ctrlStats.invalid[INVALID_OP]);
+		}
+	}
+}
+
+// Sum of a counter over all the threads
+static uint64_t total(size_t offset)
+{
+	uint64_t sum = atomic_load_explicit((_Atomic uint64_t *)((char *)&ctrlStats + offset), memory_order_relaxed);
+	for (int i = 0; i < workerCount; i++)
+		sum += atomic_load_explicit((_Atomic uint64_t *)((char *)&workers[i].stats + offset), memory_order_relaxed);
+	return sum;
+}
+#define TOTAL(field) total(offsetof(Stats, field))
+
+static void printMetric(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Access point labels. Names can contain any character.
+static void printApLabels(FILE *f, const AccessPoint *ap)
+{
+	fprintf(f, "{name=\"");
+	for (const char *p = ap->name; *p != '\0'; p++)
+	{
+		if (*p == '\\' || *p == '"')
+			fputc('\\', f);
+		fputc(*p, f);
+	}
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &ap->internalIp, ip, sizeof(ip));
+	fprintf(f, "\",ip=\"%s\"}", ip);
+}
+
+static void writeMetrics(FILE *f)
+{
+	printMetric(f, "discoping_packets_received_total", "counter", "Valid packets received by op. Pings answered by XDP are not included.");
+	fprintf(f, "discoping_packets_received_total{op=\"ping\"} %lu\n", (unsigned long)TOTAL(received[PING]));
+	fprintf(f, "discoping_packets_received_total{op=\"pong\"} %lu\n", (unsigned long)TOTAL(received[PONG]));
+	fprintf(f, "discoping_packets_received_total{op=\"discover\"} %lu\n", (unsigned long)TOTAL(received[DISCOVER]));
+	printMetric(f, "discoping_replies_sent_total", "counter", "Replies sent by op.");
+	fprintf(f, "discoping_replies_sent_total{op=\"pong\"} %lu\n", (unsigned long)TOTAL(pongs));
+	fprintf(f, "discoping_replies_sent_total{op=\"discover\"} %lu\n", (unsigned long)TOTAL(discoReplies));
+	fprintf(f, "discoping_replies_sent_total{op=\"discover_extended\"} %lu\n", (unsigned long)TOTAL(extDiscoReplies));
+	printMetric(f, "discoping_discover_rate_limited_total", "counter", "DISCOVER requests dropped by the rate limiter.");
+	fprintf(f, "discoping_discover_rate_limited_total %lu\n", (unsigned long)TOTAL(rateLimited));
+	printMetric(f, "discoping_invalid_packets_total", "counter", "Invalid packets received by reason. Packets dropped by the socket filter are not included.");
+	for (int i = 0; i < INVALID_REASON_COUNT; i++)
+		fprintf(f, "discoping_invalid_packets_total{reason=\"%s\"} %lu\n", invalidReasons[i], (unsigned long)total(offsetof(Stats, invalid) + (size_t)i * sizeof(uint64_t)));
+	printMetric(f, "discoping_send_errors_total", "counter", "Datagrams that couldn't be sent.");
+	fprintf(f, "discoping_send_errors_total %lu\n", (unsigned long)TOTAL(sendErrors));
+	if (xdpInterface != NULL) {
+		printMetric(f, "discoping_xdp_pings_reflected_total", "counter", "Pings answered by the XDP program.");
+		fprintf(f, "discoping_xdp_pings_reflected_total %lu\n", (unsigned long)pingXdpCounter(XDP_PINGS_REFLECTED));
+	}
+	printMetric(f, "discoping_refresh_duration_seconds", "gauge", "Duration of the last access points file load.");
+	fprintf(f, "discoping_refresh_duration_seconds %.6f\n", (double)refreshDuration / 1e6);
+	printMetric(f, "discoping_dns_duration_seconds", "gauge", "Duration of the last resolution of all the access point names.");
+	fprintf(f, "discoping_dns_duration_seconds %.6f\n", (double)atomic_load_explicit(&dnsDuration, memory_order_relaxed) / 1e6);
+	printMetric(f, "discoping_dns_failures_total", "counter", "Access point names that couldn't be resolved.");
+	fprintf(f, "discoping_dns_failures_total %lu\n", (unsigned long)atomic_load_explicit(&dnsFailures, memory_order_relaxed));
+	printMetric(f, "discoping_access_points", "gauge", "Access points in the list.");
+	fprintf(f, "discoping_access_points %d\n", apCount);
+	printMetric(f, "discoping_sessions", "gauge", "Sessions open on this access point.");
+	fprintf(f, "discoping_sessions{type=\"bba\"} %u\n", bbaSessions);
+	fprintf(f, "discoping_sessions{type=\"dialup\"} %u\n", dialupSessions);
+
+	// Probed access points
+	printMetric(f, "discoping_access_point_up", "gauge", "1 if the access point answers probes.");
+	for (int i = 0; i < apCount; i++)
+		if (accessPoints[i].internalIp != 0) {
+			fprintf(f, "discoping_access_point_up");
+			printApLabels(f, &accessPoints[i]);
+			fprintf(f, " %d\n", !accessPoints[i].offline);
+		}
+	printMetric(f, "discoping_access_point_rtt_seconds", "gauge", "Smoothed probe round-trip time.");
+	for (int i = 0; i < apCount; i++)
+		if (accessPoints[i].internalIp != 0 && accessPoints[i].probe.sampleCount != 0) {
+			fprintf(f, "discoping_access_point_rtt_seconds");
+			printApLabels(f, &accessPoints[i]);
+			fprintf(f, " %.6f\n", accessPoints[i].probe.srtt / 1e6);
+		}
+	printMetric(f, "discoping_access_point_rtt_jitter_seconds", "gauge", "Smoothed probe round-trip time deviation.");
+	for (int i = 0; i < apCount; i++)
+		if (accessPoints[i].internalIp != 0 && accessPoints[i].probe.sampleCount != 0) {
+			fprintf(f, "discoping_access_point_rtt_jitter_seconds");
+			printApLabels(f, &accessPoints[i]);
+			fprintf(f, " %.6f\n", accessPoints[i].probe.rttvar / 1e6);
+		}
+	printMetric(f, "discoping_access_point_probes_total", "counter", "Probes sent to the access point.");
+	for (int i = 0; i < apCount; i++)
+		if (accessPoints[i].internalIp != 0) {
+			fprintf(f, "discoping_access_point_probes_total");
+			printApLabels(f, &accessPoints[i]);
+			fprintf(f, " %lu\n", (unsigned long)accessPoints[i].probe.probes);
+		}
+	printMetric(f, "discoping_access_point_probe_losses_total", "counter", "Probes that weren't answered in time.");
+	for (int i = 0; i < apCount; i++)
+		if (accessPoints[i].internalIp != 0) {
+			fprintf(f, "discoping_access_point_probe_losses_total");
+			printApLabels(f, &accessPoints[i]);
+			fprintf(f, " %lu\n", (unsigned long)accessPoints[i].probe.losses);
+		}
+	printMetric(f, "discoping_access_point_load_ratio", "gauge", "Sessions of the access point divided by its capacity, as reported by the access point.");
+	for (int i = 0; i < apCount; i++)
+		if (accessPoints[i].internalIp != 0 && loadPercent(&accessPoints[i]) != LOAD_UNKNOWN) {
+			const AccessPoint *ap = &accessPoints[i];
+			fprintf(f, "discoping_access_point_load_ratio");
+			printApLabels(f, ap);
+			fprintf(f, " %.3f\n", ((double)ap->load.bbaSessions + ap->load.dialupSessions) / ap->load.capacity);
+		}
+}
+
+void startMetrics()
+{
+	for (int i = 0; i < METRICS_CLIENTS; i++)
+		metricsClients[i].fd = -1;
+	metricsSock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (metricsSock < 0)
+		error("ERROR opening metrics socket");
+	int optval = 1;
+	setsockopt(metricsSock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)metricsPort);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(metricsSock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		error("ERROR: bind(metrics)");
+	if (listen(metricsSock, METRICS_BACKLOG) < 0)
+		error("ERROR: listen(metrics)");
+}
+
+static void closeMetricsClient(MetricsClient *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	free(c->reply);
+	c->reply = NULL;
+}
+
+// Accept new metrics connections, as long as a slot is free
+void acceptMetrics()
+{
+	for (int i = 0; i < METRICS_CLIENTS; i++)
+	{
+		MetricsClient *c = &metricsClients[i];
+		if (c->fd != -1)
+			continue;
+		c->fd = accept4(metricsSock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (c->fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+				perror("ERROR: accept(metrics)");
+			c->fd = -1;
+			break;
+		}
+		c->deadline = getTimeUs() + METRICS_TIMEOUT;
+		c->requestLen = 0;
+		c->sent = 0;
+	}
+}
+
+// Build the reply. Whatever the request is, the reply is the metrics page.
+static int buildMetricsReply(MetricsClient *c)
+{
+	char *body = NULL;
+	size_t bodyLen = 0;
+	FILE *f = open_memstream(&body, &bodyLen);
+	if (f == NULL) {
+		perror("open_memstream");
+		return 0;
+	}
+	writeMetrics(f);
+	fclose(f);
+	f = open_memstream(&c->reply, &c->replyLen);
+	if (f == NULL) {
+		perror("open_memstream");
+		free(body);
+		return 0;
+	}
+	fprintf(f, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", bodyLen);
+	fwrite(body, 1, bodyLen, f);
+	fclose(f);
+	free(body);
+	return 1;
+}
+
+// Read the request then send the reply of a metrics connection, without blocking
+void serveMetrics(MetricsClient *c)
+{
+	if (c->reply == NULL)
+	{
+		ssize_t len = recv(c->fd, c->request + c->requestLen, sizeof(c->request) - c->requestLen, 0);
+		if (len < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				closeMetricsClient(c);
+			return;
+		}
+		c->requestLen += (size_t)len;
+		// Read the request so that closing the connection doesn't reset it
+		if (len > 0 && c->requestLen < sizeof(c->request)
+				&& memmem(c->request, c->requestLen, "\r\n\r\n", 4) == NULL)
+			return;
+		if (!buildMetricsReply(c)) {
+			closeMetricsClient(c);
+			return;
+		}
+	}
+	ssize_t len = send(c->fd, c->reply + c->sent, c->replyLen - c->sent, MSG_NOSIGNAL);
+	if (len < 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			perror("ERROR: send(metrics)");
+			closeMetricsClient(c);
+		}
+		return;
+	}
+	c->sent += (size_t)len;
+	if (c->sent == c->replyLen)
+		closeMetricsClient(c);
+}
+
+// Close the metrics connections that have timed out. Returns the next deadline, or UINT64_MAX.
+uint64_t expireMetricsClients(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+	for (int i = 0; i < METRICS_CLIENTS; i++)
+	{
+		MetricsClient *c = &metricsClients[i];
+		if (c->fd == -1)
+			continue;
+		if (now >= c->deadline)
+			closeMetricsClient(c);
+		else if (c->deadline < next)
+			next = c->deadline;
+	}
+	return next;
+}
+
+static void usage(const char *progName)
+{
+	fprintf(stderr, "usage: %s [-c <capacity>] [-m <port>] [-r <rate>] [-w <workers>] [-x <interface>] [<port> [<access points file>] ]\n", progName);
+	fprintf(stderr, "Default port: %d. Default access points file: %s\n", port, accessPointsFile);
+	fprintf(stderr, "Default workers: number of CPUs (max %d)\n", MAX_WORKERS);
+	fprintf(stderr, "-c: maximum number of sessions reported to other access points (default %u)\n", capacity);
+	fprintf(stderr, "-m: serve Prometheus metrics on this port of the loopback interface\n");
+	fprintf(stderr, "-r: DISCOVER replies per second and per source address (default %u, burst %u)\n", discoverRate, discoverBurst);
+	fprintf(stderr, "-x: answer pings sent to the addresses of the given interface in the kernel with XDP\n");
+	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
 	setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
 
-	if (argc > 3) {
-		fprintf(stderr, "usage: %s [<port> [<access points file>] ]\n", argv[0]);
-		fprintf(stderr, "Default port: %d. Default access points file: %s\n", port, accessPointsFile);
-		exit(1);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	workerCount = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:m:r:w:x:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'w':
+			workerCount = atoi(optarg);
+			if (workerCount < 1 || workerCount > MAX_WORKERS) {
+				fprintf(stderr, "Number of workers must be between 1 and %d\n", MAX_WORKERS);
+				exit(1);
+			}
+			break;
+		case 'x':
+			xdpInterface = optarg;
+			break;
+		case 'm':
+			metricsPort = atoi(optarg);
+			if (metricsPort < 1 || metricsPort > 65535) {
+				fprintf(stderr, "%d is an invalid port.\n", metricsPort);
+				exit(1);
+			}
+			break;
+		case 'c':
+			{
+				int cap = atoi(optarg);
+				if (cap < 1 || cap > 65535) {
+					fprintf(stderr, "Capacity must be between 1 and 65535\n");
+					exit(1);
+				}
+				capacity = (unsigned)cap;
+			}
+			break;
+		case 'r':
+			{
+				int rate = atoi(optarg);
+				if (rate < 1 || rate > 1000) {
+					fprintf(stderr, "DISCOVER rate must be between 1 and 1000\n");
+					exit(1);
+				}
+				discoverRate = (unsigned)rate;
+				discoverBurst = discoverRate * 4;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
-	if (argc >= 2) {
-		port = (uint16_t)atoi(argv[1]);
-	    if (port < 1 || port > 65535) {
-	    	fprintf(stderr, "%d is an invalid port.\n", port);
+	if (argc - optind > 2)
+		usage(argv[0]);
+	if (argc - optind >= 1) {
+		int portArg = atoi(argv[optind]);
+	    if (portArg < 1 || portArg > 65535) {
+	    	fprintf(stderr, "%d is an invalid port.\n", portArg);
 	    	exit(1);
 	    }
-	    if (argc > 2)
-	    	accessPointsFile = argv[2];
+		port = (uint16_t)portArg;
+	    if (argc - optind > 1)
+	    	accessPointsFile = argv[optind + 1];
 	}
-    printf("[%s] Started discoping on port %d with list %s\n", getDate(), port, accessPointsFile);
+    printf("[%s] Started discoping on port %d with list %s and %d workers\n", getDate(), port, accessPointsFile, workerCount);
+    startDnsThread();
+    watchAccessPoints();
     refresh();
-	sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (sockfd < 0)
+	startWorkers();
+	if (xdpInterface != NULL)
+	{
+		if (pingXdpAttach(xdpInterface, port) == 0)
+			printf("[%s] XDP ping reflector attached to %s\n", getDate(), xdpInterface);
+		else
+			fprintf(stderr, "[%s] Can't attach XDP ping reflector to %s. Pings will be answered by the workers\n", getDate(), xdpInterface);
+	}
+	// Pings are sent from an ephemeral port so that pongs don't end up in a worker socket
+	ctrlSock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (ctrlSock < 0)
 		error("ERROR opening socket");
-	int optval = 1;
-	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-	struct sockaddr_in serveraddr;
-	serveraddr.sin_family = AF_INET;
-	serveraddr.sin_port = htons(port);
-	serveraddr.sin_addr.s_addr = INADDR_ANY;
-	int rc = bind(sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr));
-	if (rc < 0)
-		error("ERROR: bind");
-
-	int pinging = pingAccessPoints(sockfd, 1);
-	time_t nextPing = time(NULL) + (pinging ? 5 : 60);
-	struct pollfd pfd = { sockfd, POLLIN };
+	attachFilter(ctrlSock);
+	if (metricsPort != 0)
+		startMetrics();
+
+	uint64_t nextProbe = probeAccessPoints(ctrlSock);
+	// the metrics sockets are ignored if not open
+	struct pollfd pfd[4 + METRICS_CLIENTS] = {
+		{ ctrlSock, POLLIN },
+		{ dnsPipe[0], POLLIN },
+		{ inotifyFd, POLLIN },
+	};
 	for (;;)
 	{
-		pfd.revents = 0;
-		int timeout = (int)((nextPing - time(NULL)) * 1000);
+		for (int i = 0; i < 4 + METRICS_CLIENTS; i++)
+			pfd[i].revents = 0;
+		// Stop accepting when all the metrics slots are busy
+		pfd[3].fd = -1;
+		for (int i = 0; i < METRICS_CLIENTS; i++)
+		{
+			MetricsClient *c = &metricsClients[i];
+			pfd[4 + i].fd = metricsPort != 0 ? c->fd : -1;
+			pfd[4 + i].events = c->reply == NULL ? POLLIN : POLLOUT;
+			if (metricsPort != 0 && c->fd == -1) {
+				pfd[3].fd = metricsSock;
+				pfd[3].events = POLLIN;
+			}
+		}
+		uint64_t nextEvent = nextProbe;
+		if (metricsPort != 0) {
+			uint64_t metricsDeadline = expireMetricsClients(getTimeUs());
+			if (metricsDeadline < nextEvent)
+				nextEvent = metricsDeadline;
+		}
+		int64_t timeout = ((int64_t)nextEvent - (int64_t)getTimeUs() + 999) / 1000;
+		if (timeout > (lastRefresh + DNS_TTL - time(NULL)) * 1000)
+			timeout = (lastRefresh + DNS_TTL - time(NULL)) * 1000;
 		if (timeout < 0)
 			timeout = 0;
-		int rc = poll(&pfd, 1, timeout);
+		int rc = poll(pfd, 4 + METRICS_CLIENTS, (int)timeout);
 		if (rc < 0)
 			error("ERROR: poll");
-		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-			fprintf(stderr, "ERROR: poll event 0x%x\n", pfd.revents);
+		if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			fprintf(stderr, "ERROR: poll event 0x%x\n", pfd[0].revents);
 			break;
 		}
-		if (rc > 0)
+		if (pfd[1].revents & POLLIN)
+			dnsResults();
+		if (pfd[2].revents & POLLIN)
+			inotifyEvents();
+		if (time(NULL) - lastRefresh >= DNS_TTL)
 		{
-			struct sockaddr_in srcAddr;
-			socklen_t addrlen = sizeof(srcAddr);
-			uint8_t data[64];
-			ssize_t len = recvfrom(sockfd, data, sizeof(data), 0, (struct sockaddr *)&srcAddr, &addrlen);
-			if (len < 0)
-				error("ERROR: recvfrom");
-			if (len < 5) {
-				fprintf(stderr, "Invalid packet received: len %zd\n", len);
-				continue;
-			}
-			if (memcmp(&MAGIC, data, sizeof(MAGIC))) {
-				fprintf(stderr, "Invalid packet received: bad magic\n");
-				continue;
-			}
-			switch (data[4])
-			{
-			case PING:
-				pong(&srcAddr, data, (size_t)len);
-				break;
-			case DISCOVER:
-				disco(&srcAddr, data, (size_t)len);
-				break;
-			case PONG:
-				apPong(&srcAddr, data, (size_t)len);
-				break;
-			default:
-				fprintf(stderr, "Invalid packet received: bad op\n");
-				break;
-			}
-		}
-		if (time(NULL) >= nextPing) {
-			pinging = pingAccessPoints(sockfd, pinging == 0);
-			nextPing = time(NULL) + (pinging ? 5 : 60);
+			lastRefresh = time(NULL);
+			resolveAccessPoints();
+			if (xdpInterface != NULL)
+				printf("[%s] XDP pings reflected: %lu\n", getDate(), (unsigned long)pingXdpCounter(XDP_PINGS_REFLECTED));
 		}
+		if (pfd[0].revents & POLLIN)
+			ctrlPackets();
+		// Probes first: they are time sensitive
+		nextProbe = probeAccessPoints(ctrlSock);
+		for (int i = 0; i < METRICS_CLIENTS; i++)
+			if (pfd[4 + i].revents != 0 && metricsClients[i].fd != -1)
+				serveMetrics(&metricsClients[i]);
+		if (pfd[3].revents & POLLIN)
+			acceptMetrics();
 	}
-	close(sockfd);
+	close(ctrlSock);
 
 	return 0;
 }
@@ -16,6 +16,10 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include "notify.h"
+#include "redirect.h"
+#include "rtnl.h"
+#include "prolog.h"
+#include "framequeue.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <cerrno>
@@ -29,17 +33,55 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <arpa/inet.h>
+#include <linux/tcp.h>
 #include <linux/if_tun.h>
+#include <linux/filter.h>
 #include <pwd.h>
 #include <grp.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <climits>
+#include <poll.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
 #include <cassert>
 #include <ctime>
+#include <cstddef>
 
 constexpr int MAX_CONNECTIONS = 64;
+constexpr int LISTEN_BACKLOG = 128;
+constexpr int64_t PROLOG_TIMEOUT = 3000;	// ms
+// Connections waiting for a prolog, in total and per source address
+constexpr size_t MAX_PENDING = 256;
+constexpr size_t CTRL_MSG_SIZE = 64 * 1024;
+// The session stays in the old child if the new process doesn't accept it in time
+constexpr int64_t HANDOFF_TIMEOUT = 500;	// ms
+constexpr unsigned MAX_PENDING_PER_SOURCE = 4;
+constexpr unsigned DEFAULT_SESSIONS_PER_SOURCE = 8;
 constexpr time_t READ_TIMEOUT = 35 * 60;
+// TCP_INFO sampling and logging of the session link
+constexpr time_t LINK_SAMPLE_INTERVAL = 10;
+constexpr time_t LINK_LOG_INTERVAL = 5 * 60;
+// Bounds of the unsent data queued in the session socket
+constexpr int MIN_NOTSENT_LOWAT = 4 * 1024;
+constexpr int MAX_NOTSENT_LOWAT = 64 * 1024;
+constexpr int DEFAULT_NOTSENT_LOWAT = 16 * 1024;
+// Output queue: frames queued longer than the target for an interval are dropped (CoDel),
+// and frames older than the deadline are always dropped. In microseconds.
+constexpr int64_t QUEUE_TARGET = 20000;
+constexpr int64_t QUEUE_INTERVAL = 100000;
+constexpr int64_t QUEUE_DEADLINE = 500000;
+constexpr size_t QUEUE_MAX_BYTES = 64 * 1024;
+// Maximum number of frames read from the tap at once
+constexpr int TAP_READ_BATCH = 8;
+constexpr int TAP_MTU = 1500;
+// Maximum number of frames queued by fq_codel on a tap, waiting to be read by ethtap
+constexpr unsigned TAP_QUEUE_LIMIT = 1000;
+// Burst allowed by the tap rate limit, in bytes
+constexpr unsigned TAP_BURST = 16 * 1024;
 
 int child_pipe = -1;
 std::string remoteIp;
@@ -47,6 +89,49 @@ int remotePort;
 const char *dnsmasq_conf = "dnsmasq.conf";
 const char *start_ip = "172.20.1.0";
 std::string dcnetIp;
+std::string tapName;
+// Game server redirections done by ethtap instead of iptables
+const char *redirects_file;
+// Frames read from the tap, waiting to be sent to the client
+TunnelQueue outputQueue(QUEUE_TARGET, QUEUE_INTERVAL, QUEUE_DEADLINE, QUEUE_MAX_BYTES);
+// Sessions using heartbeats are closed after this time without data
+time_t deadPeerTimeout = 60;
+// Admission thresholds. New sessions are rejected or redirected when one of them is reached.
+size_t maxSessions = MAX_CONNECTIONS;
+// Sessions from a single address, 0 for no limit. Several consoles can share an address (LAN parties, CGNAT).
+unsigned maxSessionsPerSource = DEFAULT_SESSIONS_PER_SOURCE;
+double maxLoad;				// 1-minute load average per CPU, 0 to disable
+double maxUplinkMbps;		// uplink bandwidth in either direction, 0 to disable
+std::string uplinkInterface;
+// Access point to redirect new sessions to when overloaded
+std::string redirectHost;
+uint16_t redirectPort = 7655;
+// Queueing discipline and rate limit of the tap interfaces.
+// fq_codel uses the kernel default target (5 ms) and interval (100 ms). kind is null to keep the default qdisc.
+QdiscConfig tapQdisc { "fq_codel", 0, 0, TAP_QUEUE_LIMIT, 0, TAP_BURST };
+
+// Session state handed over to the new process on hot restart.
+// Change HANDOFF_LAYOUT whenever a field is added, removed, moved or changes meaning.
+// The frames waiting in the output queue aren't handed over: a hot restart drops them.
+constexpr uint32_t HANDOFF_MAGIC = 0xDC7A9E55;
+constexpr uint32_t HANDOFF_LAYOUT = 1;
+struct SessionState
+{
+	uint32_t magic = HANDOFF_MAGIC;
+	uint32_t layout = HANDOFF_LAYOUT;
+	char remoteIp[INET6_ADDRSTRLEN];
+	int remotePort;
+	char tapName[IFNAMSIZ];
+	char dcnetIp[INET_ADDRSTRLEN];
+	uint8_t version;
+	// the frame at the start of inbuf has been redirected already
+	bool inframeRedirected;
+	time_t lastSockRead;
+	unsigned inbuflen;
+	unsigned outbuflen;
+	uint8_t inbuf[1600];
+	uint8_t outbuf[1600];
+};
 
 bool setNonBlocking(int fd)
 {
@@ -61,6 +146,26 @@ bool setNonBlocking(int fd)
 	return true;
 }
 
+// Send a DCNET prolog reply to a version 2 client
+bool sendPrologReply(int sock, uint8_t version, PrologStatus status, const void *data, size_t len)
+{
+	uint8_t reply[PROLOG_REPLY_MAX];
+	if (len > sizeof(reply) - 9)
+		len = sizeof(reply) - 9;
+	uint16_t size = (uint16_t)(len + 7);
+	memcpy(&reply[0], &size, sizeof(size));
+	memcpy(&reply[2], "DCNET", 5);
+	reply[7] = std::min(version, PROLOG_V3);
+	reply[8] = status;
+	if (len > 0)
+		memcpy(&reply[9], data, len);
+	if (write(sock, reply, len + 9) != (ssize_t)(len + 9)) {
+		perror("write(prolog reply)");
+		return false;
+	}
+	return true;
+}
+
 void startDnsmasq(const std::string& ifname, const std::string& ipaddr)
 {
 	// fork twice to keep an intermediate child with su privileges,
@@ -122,29 +227,6 @@ void stopDnsmasq()
 		close(child_pipe);
 }
 
-void handleProlog(int sock)
-{
-	timeval tv {};
-	tv.tv_sec = 3;
-	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-	uint16_t size;
-	uint8_t buf[6];
-	if (read(sock, &size, sizeof(size)) != sizeof(size)
-			|| size != sizeof(buf)
-			|| read(sock, buf, sizeof(buf)) != sizeof(buf)
-			|| memcmp(buf, "DCNET", 5)) {
-		fprintf(stderr, "Invalid prolog or timeout\n");
-		exit(1);
-	}
-	if (buf[5] != 1) {
-		fprintf(stderr, "Unknown protocol version: %d\n", buf[5]);
-		exit(1);
-	}
-	// reset recv timeout to default
-	tv.tv_sec = 0;
-	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-}
-
 static const char *getDate()
 {
 	time_t now;
@@ -154,16 +236,200 @@ static const char *getDate()
 	return nowstr;
 }
 
+static int64_t getTimeUs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double elapsedMs(const timespec& from, const timespec& to)
+{
+	return (double)(to.tv_sec - from.tv_sec) * 1000.0 + (double)(to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+// Drop the frames a Dreamcast can't use before they reach user space:
+// multicast (but broadcast) and anything but IPv4 and ARP.
+// The dropped frames are counted in the interface tx_dropped statistic.
+static void attachTapFilter(int tap_fd)
+{
+	sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, 0, 4),			// multicast
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffffffff, 0, 5),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffff, 0, 3),		// not broadcast
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 2, 0),		// IPv4
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0806, 1, 0),		// ARP
+		BPF_STMT(BPF_RET | BPF_K, 0),							// drop
+		BPF_STMT(BPF_RET | BPF_K, 0xffff),						// accept
+	};
+	sock_fprog prog { sizeof(code) / sizeof(code[0]), code };
+	if (ioctl(tap_fd, TUNATTACHFILTER, &prog))
+		perror("ioctl(TUNATTACHFILTER)");
+}
+
+// Number of frames dropped by the tap filter
+static unsigned long filteredFrames()
+{
+	std::string path = "/sys/class/net/" + tapName + "/statistics/tx_dropped";
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == nullptr)
+		return 0;
+	unsigned long count = 0;
+	if (fscanf(f, "%lu", &count) != 1)
+		count = 0;
+	fclose(f);
+	return count;
+}
+
 static void logend() {
 	dcnetDisconnect(dcnetIp.c_str());
-	fprintf(stderr, "[%s] Link to %s:%d closed\n", getDate(), remoteIp.c_str(), remotePort);
+	fprintf(stderr, "[%s] Link to %s:%d closed. %lu frames filtered, %lu stale frames dropped\n", getDate(), remoteIp.c_str(), remotePort,
+			filteredFrames(), (unsigned long)outputQueue.droppedFrames());
+}
+
+static void dropPrivileges()
+{
+	uid_t gid = 65534;
+	group *grp = getgrnam("nogroup");
+	if (grp != nullptr)
+		gid = grp->gr_gid;
+	if (setgid(gid))
+		error(-1, errno, "setgid");
+	uid_t uid = 65534;
+	passwd *user = getpwnam("nobody");
+	if (user != nullptr)
+		uid = user->pw_uid;
+	if (setuid(uid))
+		error(-1, errno, "setuid");
+}
+
+// Messages from the parent process on the control socket:
+// 'H' hand the session over, 'A'/'N' handoff accepted/refused, 'R' + encoded redirections,
+// 'G'/'X' start/drop a session taken over once the previous child has quit/kept it.
+// Messages to the parent: the handoff, then 'Q' quitting after 'A', or 'C' keeping the session.
+static uint8_t ctrlMsg[CTRL_MSG_SIZE];
+
+// Read a control message into ctrlMsg. Redirection updates are applied here.
+static ssize_t readControl(int ctrl)
+{
+	ssize_t len;
+	while ((len = recv(ctrl, ctrlMsg, sizeof(ctrlMsg), 0)) < 0 && errno == EINTR)
+		;
+	if (len > 0 && ctrlMsg[0] == 'R' && !decodeRedirects(ctrlMsg + 1, (size_t)len - 1))
+		fprintf(stderr, "[%s] Invalid redirections received\n", getDate());
+	return len;
+}
+
+// Pass the session socket, tap and dnsmasq pipe to the new ethtap process
+static bool handOver(int ctrl, int sock, int tap_fd, const SessionState& state)
+{
+	int fds[] = { sock, tap_fd, child_pipe };
+	size_t nfds = child_pipe >= 0 ? 3 : 2;
+	iovec iov { (void *)&state, sizeof(state) };
+	union {
+		cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control {};
+	msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	if (sendmsg(ctrl, &msg, 0) < 0) {
+		perror("sendmsg(handoff)");
+		return false;
+	}
+	// The session goes on here unless the new process confirms in time that it has started a child for it
+	int64_t deadline = getTimeUs() / 1000 + HANDOFF_TIMEOUT;
+	for (;;)
+	{
+		pollfd pfd { ctrl, POLLIN, 0 };
+		int rc = poll(&pfd, 1, (int)std::max<int64_t>(0, deadline - getTimeUs() / 1000));
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			break;
+		ssize_t len = readControl(ctrl);
+		if (len > 0 && ctrlMsg[0] == 'R')
+			continue;
+		if (len == 1 && ctrlMsg[0] == 'A') {
+			// The new child starts when this one has quit
+			send(ctrl, "Q", 1, MSG_NOSIGNAL);
+			return true;
+		}
+		break;
+	}
+	// Also cancels a handoff that the new process hasn't processed yet
+	send(ctrl, "C", 1, MSG_NOSIGNAL);
+	fprintf(stderr, "[%s] Handoff of %s:%d refused or timed out: session continues\n", getDate(), remoteIp.c_str(), remotePort);
+	return false;
+}
+
+static void runSession(int sock, int tap_fd, int ctrl, SessionState& state);
+
+static int notsentLowat;
+
+// Latency-oriented socket options
+static void setSessionSocketOptions(int sock, uint8_t version)
+{
+	int one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	// Keep the unsent data in the socket small so that frames aren't delayed behind a standing queue.
+	// Adjusted to the bandwidth-delay product once known.
+	notsentLowat = DEFAULT_NOTSENT_LOWAT;
+	setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsentLowat, sizeof(notsentLowat));
+	// Don't wait for the default TCP retransmission timeout (~15 min) if the peer is gone.
+	// Older clients don't send heartbeats: they keep the kernel default.
+	if (version >= PROLOG_V3) {
+		unsigned userTimeout = (unsigned)deadPeerTimeout * 1000;
+		setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+	}
 }
 
-void handleConnection(int sock)
+// Read the TCP_INFO of the session socket, size the socket unsent queue to the bandwidth-delay product,
+// and log the link metrics if needed.
+static void sampleLink(int sock, bool log)
+{
+	tcp_info info {};
+	socklen_t len = sizeof(info);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len))
+		return;
+	uint64_t deliveryRate = 0;	// bytes/s
+	if (len >= offsetof(tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate))
+		deliveryRate = info.tcpi_delivery_rate;
+	// The delivery rate is only significant when the sender isn't limited by the application
+	if (deliveryRate > 0 && !info.tcpi_delivery_rate_app_limited)
+	{
+		uint64_t bdp = deliveryRate * info.tcpi_rtt / 1000000;
+		int lowat = (int)std::clamp<uint64_t>(bdp, MIN_NOTSENT_LOWAT, MAX_NOTSENT_LOWAT);
+		if (lowat != notsentLowat && setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == 0)
+			notsentLowat = lowat;
+	}
+	if (log)
+		fprintf(stderr, "[%s] %s: link to %s:%d: rtt %.1f ms (var %.1f, min %.1f), retransmits %u/%u, "
+				"delivery rate %.2f Mbit/s%s, cwnd %u, unsent limit %d\n",
+				getDate(), tapName.c_str(), remoteIp.c_str(), remotePort,
+				info.tcpi_rtt / 1000.0, info.tcpi_rttvar / 1000.0, info.tcpi_min_rtt / 1000.0,
+				info.tcpi_total_retrans, info.tcpi_segs_out,
+				(double)deliveryRate * 8.0 / 1e6, info.tcpi_delivery_rate_app_limited ? " (app limited)" : "",
+				info.tcpi_snd_cwnd, notsentLowat);
+}
+
+void handleConnection(int sock, uint8_t version, int ctrl)
 {
-	handleProlog(sock);
 	fprintf(stderr, "[%s] Connection from %s:%d\n", getDate(), remoteIp.c_str(), remotePort);
 
+	timespec setupStart;
+	clock_gettime(CLOCK_MONOTONIC, &setupStart);
 	int tap_fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
 	if (tap_fd < 0)
 		error(-1, errno, "/dev/net/tun");
@@ -173,9 +439,10 @@ void handleConnection(int sock)
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
 	if (ioctl(tap_fd, TUNSETIFF, &ifr))
 		error(-1, errno, "ioctl(TUNSETIFF)");
+	attachTapFilter(tap_fd);
 
-	// Set interface IP address
 	std::string ifname(ifr.ifr_name);
+	tapName = ifname;
 	if (ifname.substr(0, 3) != "tap" || !isdigit(ifname[3])) {
 		fprintf(stderr, "Unknown interface %s. Aborting\n", ifname.c_str());
 		exit(1);
@@ -183,6 +450,10 @@ void handleConnection(int sock)
 	int ifnum = atoi(&ifname[3]);
 	if (ifnum >= MAX_CONNECTIONS) {
 		fprintf(stderr, "Maximum BBA connections reached: %d\n", ifnum);
+		if (version >= PROLOG_V2) {
+			uint8_t reject[] = { REJECT_FULL, 'f', 'u', 'l', 'l' };
+			sendPrologReply(sock, version, PROLOG_REJECT, reject, sizeof(reject));
+		}
 		exit(1);
 	}
 	in_addr inaddr;
@@ -191,44 +462,37 @@ void handleConnection(int sock)
 
 	std::string ipaddr = inet_ntoa(inaddr);
 	fprintf(stderr, "%s:%d: interface %s - IP address %s\n", remoteIp.c_str(), remotePort, ifname.c_str(), ipaddr.c_str());
-	sockaddr_in *ifaddr = (sockaddr_in *)&ifr.ifr_addr;
-	ifaddr->sin_family = AF_INET;
-	inet_pton(AF_INET, ipaddr.c_str(), &ifaddr->sin_addr);
-	// Create a dummy IPv4 socket because these ioctls must be done on a socket.
-	int dummy = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (ioctl(dummy, SIOCSIFADDR, &ifr))
-		error(-1, errno, "ioctl(SIOCSIFADDR)");
-
-	// Set network mask
-	ifaddr = (sockaddr_in *)&ifr.ifr_netmask;
-	ifaddr->sin_family = AF_INET;
-	inet_pton(AF_INET, "255.255.255.254", &ifaddr->sin_addr);
-	if (ioctl(dummy, SIOCSIFNETMASK, &ifr))
-		error(-1, errno, "ioctl(SIOCSIFNETMASK)");
-
-	// Set interface up
-	ioctl(dummy, SIOCGIFFLAGS, &ifr);
-	ifr.ifr_flags |= (IFF_UP | IFF_RUNNING);
-	if (ioctl(dummy, SIOCSIFFLAGS, &ifr))
-		error(-1, errno, "ioctl(SIOCSIFFLAGS)");
-	close(dummy);
+	// Address, MTU, qdisc and link state in one netlink batch: a single send and a single wait
+	// for the acks instead of a process or a round trip per step. The kernel still takes the RTNL
+	// lock for each message.
+	timespec netlinkStart;
+	clock_gettime(CLOCK_MONOTONIC, &netlinkStart);
+	if (rtnlSetupInterface(ifname.c_str(), inaddr, 31, TAP_MTU, tapQdisc.kind != nullptr || tapQdisc.rateKbps > 0 ? &tapQdisc : nullptr))
+		exit(1);
+	timespec dnsmasqStart;
+	clock_gettime(CLOCK_MONOTONIC, &dnsmasqStart);
 
 	ipaddr[ipaddr.length() - 1] += 1;
 	startDnsmasq(ifname, ipaddr);
+	if (version >= PROLOG_V2)
+	{
+		// Tell the client which address its console gets, and how often to send heartbeats
+		uint8_t accept[6];
+		in_addr consoleAddr;
+		inet_aton(ipaddr.c_str(), &consoleAddr);
+		memcpy(&accept[0], &consoleAddr, sizeof(consoleAddr));
+		uint16_t interval = htons((uint16_t)std::max<time_t>(1, deadPeerTimeout / 3));
+		memcpy(&accept[4], &interval, sizeof(interval));
+		if (!sendPrologReply(sock, version, PROLOG_ACCEPT, accept, version >= PROLOG_V3 ? 6 : 4))
+			exit(1);
+	}
+	timespec setupEnd;
+	clock_gettime(CLOCK_MONOTONIC, &setupEnd);
+	fprintf(stderr, "%s: setup time: tap %.2f ms, netlink %.2f ms, dnsmasq %.2f ms\n", ifname.c_str(),
+			elapsedMs(setupStart, netlinkStart), elapsedMs(netlinkStart, dnsmasqStart), elapsedMs(dnsmasqStart, setupEnd));
 
 	// Leave superuser mode
-	uid_t gid = 65534;
-	group *grp = getgrnam("nogroup");
-	if (grp != nullptr)
-		gid = grp->gr_gid;
-	if (setgid(gid))
-		error(-1, errno, "setgid");
-	uid_t uid = 65534;
-	passwd *user = getpwnam("nobody");
-	if (user != nullptr)
-		uid = user->pw_uid;
-	if (setuid(uid))
-		error(-1, errno, "setuid");
+	dropPrivileges();
 	atexit(logend);
 	// Notify the new login
 	dcnetIp = ipaddr;
@@ -236,21 +500,77 @@ void handleConnection(int sock)
 
 	setNonBlocking(tap_fd);
 	setNonBlocking(sock);
+	setSessionSocketOptions(sock, version);
 
-	uint8_t inbuf[1600];
-	uint8_t outbuf[1600];
-	unsigned inbuflen = 0;
-	unsigned outbuflen = 0;
-	time_t last_sock_read = time(NULL);
+	SessionState state {};
+	strncpy(state.remoteIp, remoteIp.c_str(), sizeof(state.remoteIp) - 1);
+	state.remotePort = remotePort;
+	strncpy(state.tapName, tapName.c_str(), sizeof(state.tapName) - 1);
+	strncpy(state.dcnetIp, dcnetIp.c_str(), sizeof(state.dcnetIp) - 1);
+	state.version = version;
+	state.lastSockRead = time(NULL);
+	runSession(sock, tap_fd, ctrl, state);
+}
+
+// Continue a session handed over by the previous ethtap process
+static void resumeSession(int sock, int tap_fd, int ctrl, SessionState& state)
+{
+	remoteIp = state.remoteIp;
+	remotePort = state.remotePort;
+	tapName = state.tapName;
+	dcnetIp = state.dcnetIp;
+	// Wait until the previous child has quit. It keeps the session if the handoff timed out on its side.
 	for (;;)
 	{
+		ssize_t len = readControl(ctrl);
+		if (len > 0 && ctrlMsg[0] == 'R')
+			continue;
+		if (len == 1 && ctrlMsg[0] == 'G')
+			break;
+		_exit(0);
+	}
+	fprintf(stderr, "[%s] Session of %s:%d on %s taken over\n", getDate(), remoteIp.c_str(), remotePort, tapName.c_str());
+	// Keep adapting the unsent data limit from the value set by the previous process
+	socklen_t len = sizeof(notsentLowat);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsentLowat, &len) < 0)
+		perror("getsockopt(TCP_NOTSENT_LOWAT)");
+	dropPrivileges();
+	atexit(logend);
+	runSession(sock, tap_fd, ctrl, state);
+}
+
+static void runSession(int sock, int tap_fd, int ctrl, SessionState& state)
+{
+	auto& inbuf = state.inbuf;
+	auto& outbuf = state.outbuf;
+	unsigned& inbuflen = state.inbuflen;
+	unsigned& outbuflen = state.outbuflen;
+	bool& inframe_redirected = state.inframeRedirected;
+	time_t& last_sock_read = state.lastSockRead;
+	const time_t readTimeout = state.version >= PROLOG_V3 ? deadPeerTimeout : READ_TIMEOUT;
+	time_t nextLinkSample = time(nullptr) + LINK_SAMPLE_INTERVAL;
+	time_t nextLinkLog = time(nullptr) + LINK_LOG_INTERVAL;
+	for (;;)
+	{
+		// Heartbeats are zero-length frames, answered if nothing is being sent already
+		while (inbuflen >= 2 && *(uint16_t *)&inbuf[0] == 0)
+		{
+			inbuflen -= 2;
+			memmove(inbuf, inbuf + 2, (size_t)inbuflen);
+			if (state.version >= PROLOG_V3 && outbuflen == 0) {
+				*(uint16_t *)&outbuf[0] = 0;
+				outbuflen = 2;
+			}
+		}
 		fd_set readfds;
 		FD_ZERO(&readfds);
 		if (inbuflen < sizeof(inbuf))
 			FD_SET(sock, &readfds);
-		if (outbuflen == 0)
-			// Don't read from tap until the current frame is sent out
-			FD_SET(tap_fd, &readfds);
+		// The tap is always drained: stale frames are dropped from the output queue
+		// instead of waiting in the kernel tap queue
+		FD_SET(tap_fd, &readfds);
+		if (ctrl >= 0)
+			FD_SET(ctrl, &readfds);
 
 		fd_set writefds;
 		FD_ZERO(&writefds);
@@ -262,16 +582,25 @@ void handleConnection(int sock)
 			if (inbuflen >= framelen + 2u)
 				FD_SET(tap_fd, &writefds);
 		}
-		if (outbuflen > 0)
+		if (outbuflen > 0 || !outputQueue.empty())
 			FD_SET(sock, &writefds);
 
-		int nfds = (sock > tap_fd ? sock : tap_fd) + 1;
+		int nfds = std::max({ sock, tap_fd, ctrl }) + 1;
 		timeval tv;
-		tv.tv_sec = READ_TIMEOUT - (time(NULL) - last_sock_read);
+		time_t now = time(nullptr);
+		if (now >= nextLinkSample)
+		{
+			sampleLink(sock, now >= nextLinkLog);
+			nextLinkSample = now + LINK_SAMPLE_INTERVAL;
+			if (now >= nextLinkLog)
+				nextLinkLog = now + LINK_LOG_INTERVAL;
+		}
+		tv.tv_sec = readTimeout - (now - last_sock_read);
 		if (tv.tv_sec <= 0) {
-			fprintf(stderr, "No data received for 35 min. Closing connection\n");
+			fprintf(stderr, "No data received for %ld s. Closing connection\n", (long)readTimeout);
 			break;
 		}
+		tv.tv_sec = std::min(tv.tv_sec, nextLinkSample - now);
 		tv.tv_usec = 0;
 		if (select(nfds, &readfds, &writefds, nullptr, &tv) == -1)
 		{
@@ -280,34 +609,51 @@ void handleConnection(int sock)
 			perror("select");
 			break;
 		}
+		if (ctrl >= 0 && FD_ISSET(ctrl, &readfds))
+		{
+			if (readControl(ctrl) <= 0) {
+				// Parent is gone
+				close(ctrl);
+				ctrl = -1;
+			}
+			else if (ctrlMsg[0] == 'H' && handOver(ctrl, sock, tap_fd, state)) {
+				// The session goes on in the new process
+				_exit(0);
+			}
+		}
 		if (FD_ISSET(tap_fd, &readfds))
 		{
-			ssize_t ret = read(tap_fd, outbuf + 2, sizeof(outbuf) - 2u);
-			if (ret < 0)
+			bool tapClosed = false;
+			for (int i = 0; i < TAP_READ_BATCH; i++)
 			{
-				if (errno != EINTR && errno != EWOULDBLOCK) {
-					perror("read(tap)");
+				uint8_t frame[FrameQueue::MAX_FRAME_SIZE];
+				ssize_t ret = read(tap_fd, frame, sizeof(frame));
+				if (ret < 0)
+				{
+					if (errno != EINTR && errno != EWOULDBLOCK) {
+						perror("read(tap)");
+						tapClosed = true;
+					}
 					break;
 				}
-				ret = 0;
-			}
-			else if (ret == 0) {
-				break;
-			}
-			if (ret > 0)
-			{
-				uint8_t mac0 = outbuf[2];
+				else if (ret == 0) {
+					tapClosed = true;
+					break;
+				}
+				// Already filtered by the kernel unless the filter couldn't be attached
+				uint8_t mac0 = frame[0];
 				if ((mac0 & 1) && mac0 != 0xff) {
 					//printf("Out frame: multicast filtered\n");
 				}
 				else
 				{
 					//printf("Out frame: %zd\n", ret);
-					*(uint16_t *)&outbuf[0] = ret;
-					outbuflen = ret + 2;
-					FD_SET(sock, &writefds);
+					redirectToConsole(frame, (size_t)ret);
+					outputQueue.push(frame, (size_t)ret, getTimeUs());
 				}
 			}
+			if (tapClosed)
+				break;
 		}
 		if (FD_ISSET(sock, &readfds))
 		{
@@ -333,9 +679,14 @@ void handleConnection(int sock)
 		if (FD_ISSET(tap_fd, &writefds))
 		{
 			uint16_t framelen = *(uint16_t *)&inbuf[0];
-			if (inbuflen >= framelen + 2u)
+			// Heartbeats are skipped at the beginning of the loop
+			if (framelen > 0 && inbuflen >= framelen + 2u)
 			{
 				//printf("In frame: %d\n", framelen);
+				if (!inframe_redirected) {
+					redirectFromConsole(inbuf + 2, framelen);
+					inframe_redirected = true;
+				}
 				ssize_t ret = write(tap_fd, inbuf + 2, framelen);
 				if (ret < 0) {
 					if (errno != EINTR && errno != EWOULDBLOCK) {
@@ -349,12 +700,21 @@ void handleConnection(int sock)
 					if (ret != framelen)
 						fprintf(stderr, "WARNING: tap write truncated %d -> %zd\n", framelen, ret);
 					inbuflen -= framelen + 2;
+					inframe_redirected = false;
 					if (inbuflen > 0)
 						memmove(inbuf, inbuf + framelen + 2, (size_t)inbuflen);
 				}
 			}
 		}
-		if (FD_ISSET(sock, &writefds))
+		if (FD_ISSET(sock, &writefds) && outbuflen == 0)
+		{
+			size_t framelen = outputQueue.pop(outbuf + 2, sizeof(outbuf) - 2u, getTimeUs());
+			if (framelen > 0) {
+				*(uint16_t *)&outbuf[0] = (uint16_t)framelen;
+				outbuflen = (unsigned)framelen + 2;
+			}
+		}
+		if (FD_ISSET(sock, &writefds) && outbuflen > 0)
 		{
 			ssize_t ret = write(sock, outbuf, (size_t)outbuflen);
 			if (ret < 0) {
@@ -385,86 +745,745 @@ void handleConnection(int sock)
 		 *(uint16_t *)&buf[12], i);
 		 */
 	}
+	sampleLink(sock, true);
 	close(sock);
 	close(tap_fd);
 	stopDnsmasq();
 	exit(0);
 }
 
-int main(int argc, char *argv[])
+struct PendingConnection
 {
-	setvbuf(stdout, nullptr, _IOLBF, BUFSIZ);
-	signal(SIGCHLD, SIG_IGN);
+	int sock;
+	std::string ip;
+	int port;
+	int64_t deadline;
+	uint8_t prolog[PROLOG_SIZE];
+	unsigned size;
+};
+// Connections waiting for their prolog
+static std::vector<PendingConnection> pending;
+struct Session
+{
+	std::string ip;
+	// Control socket, used for hot restarts
+	int ctrl;
+	// Child that resumes this session after a handoff, once this one has quit
+	pid_t successor = 0;
+};
+// Running sessions by child pid
+static std::map<pid_t, Session> sessions;
+static int listenSock = -1;
+static volatile sig_atomic_t restartRequested;
+// Path of the ethtap executable and arguments, for hot restarts
+static char exePath[PATH_MAX];
+static char **savedArgv;
 
-	int opt;
-	while ((opt = getopt(argc, argv, "d:i:")) != -1) {
-		switch (opt) {
-		case 'd':
-			dnsmasq_conf = optarg;
+static int64_t getTimeMs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void getRemoteAddress(const sockaddr_storage& src_addr, std::string& ip, int& port)
+{
+#ifdef IPV4_ONLY
+	const sockaddr_in *ipv4addr = (const sockaddr_in *)&src_addr;
+	ip = inet_ntoa(ipv4addr->sin_addr);
+	port = ntohs(ipv4addr->sin_port);
+#else
+	char hostname[INET6_ADDRSTRLEN];
+	if (src_addr.ss_family == AF_INET) {
+		inet_ntop(AF_INET, &((const sockaddr_in *)&src_addr)->sin_addr, hostname, sizeof(hostname));
+		port = ntohs(((const sockaddr_in *)&src_addr)->sin_port);
+	}
+	else {
+		inet_ntop(AF_INET6, &((const sockaddr_in6 *)&src_addr)->sin6_addr, hostname, sizeof(hostname));
+		if (!strncmp(hostname, "::ffff:", 7))
+			// Get rid of the IPv6 prefix for IPv4-mapped addresses
+			memmove(hostname, hostname + 7, strlen(hostname) + 1 - 7);
+		port = ntohs(((const sockaddr_in6 *)&src_addr)->sin6_port);
+	}
+	ip = hostname;
+#endif
+}
+
+static unsigned sourcePending(const std::string& ip)
+{
+	unsigned count = 0;
+	for (const PendingConnection& conn : pending)
+		if (conn.ip == ip)
+			count++;
+	return count;
+}
+
+static unsigned sourceSessions(const std::string& ip)
+{
+	unsigned count = 0;
+	for (const auto& [pid, session] : sessions)
+		if (session.ip == ip)
+			count++;
+	return count;
+}
+
+static void acceptConnections()
+{
+	for (;;)
+	{
+		sockaddr_storage src_addr;
+		socklen_t addr_len = sizeof(src_addr);
+		int sock = accept4(listenSock, (sockaddr *)&src_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		PendingConnection conn {};
+		conn.sock = sock;
+		getRemoteAddress(src_addr, conn.ip, conn.port);
+		if (sourcePending(conn.ip) >= MAX_PENDING_PER_SOURCE) {
+			fprintf(stderr, "[%s] Connection from %s:%d refused: too many pending connections from this address\n", getDate(), conn.ip.c_str(), conn.port);
+			close(sock);
+			continue;
+		}
+		if (pending.size() >= MAX_PENDING) {
+			// Give up on the oldest one
+			close(pending.front().sock);
+			pending.erase(pending.begin());
+		}
+		conn.deadline = getTimeMs() + PROLOG_TIMEOUT;
+		pending.push_back(conn);
+	}
+}
+
+// Returns 1 if the prolog is complete and valid, 0 if more data is needed, -1 on error
+static int readProlog(PendingConnection& conn)
+{
+	ssize_t len = read(conn.sock, &conn.prolog[conn.size], PROLOG_SIZE - conn.size);
+	if (len < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	if (len == 0) {
+		fprintf(stderr, "[%s] %s:%d: Connection closed before prolog\n", getDate(), conn.ip.c_str(), conn.port);
+		return -1;
+	}
+	conn.size += (unsigned)len;
+	if (conn.size < PROLOG_SIZE)
+		return 0;
+	uint16_t size;
+	memcpy(&size, conn.prolog, sizeof(size));
+	if (size != PROLOG_SIZE - sizeof(size) || memcmp(&conn.prolog[2], "DCNET", 5)) {
+		fprintf(stderr, "[%s] %s:%d: Invalid prolog\n", getDate(), conn.ip.c_str(), conn.port);
+		return -1;
+	}
+	if (conn.prolog[7] < PROLOG_V1 || conn.prolog[7] > PROLOG_V3) {
+		fprintf(stderr, "[%s] %s:%d: Unknown protocol version: %d\n", getDate(), conn.ip.c_str(), conn.port, conn.prolog[7]);
+		if (conn.prolog[7] > PROLOG_V3) {
+			const char reject[] = { REJECT_VERSION, 'v', 'e', 'r', 's', 'i', 'o', 'n' };
+			sendPrologReply(conn.sock, conn.prolog[7], PROLOG_REJECT, reject, sizeof(reject));
+		}
+		return -1;
+	}
+	return 1;
+}
+
+// Name of the default route interface
+static std::string defaultInterface()
+{
+	FILE *f = fopen("/proc/net/route", "r");
+	if (f == nullptr)
+		return "";
+	char line[256];
+	std::string name;
+	while (fgets(line, sizeof(line), f) != nullptr)
+	{
+		char ifname[IFNAMSIZ + 1];
+		unsigned dest;
+		if (sscanf(line, "%16s %x", ifname, &dest) == 2 && dest == 0) {
+			name = ifname;
 			break;
-		case 'i':
-			start_ip = optarg;
+		}
+	}
+	fclose(f);
+	return name;
+}
+
+static uint64_t readCounter(const std::string& path)
+{
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == nullptr)
+		return 0;
+	unsigned long long value = 0;
+	if (fscanf(f, "%llu", &value) != 1)
+		value = 0;
+	fclose(f);
+	return value;
+}
+
+static double uplinkMbps;
+
+// Measure the uplink bandwidth every second
+static void sampleUplink()
+{
+	static int64_t lastSample;
+	static uint64_t lastRx, lastTx;
+	int64_t now = getTimeMs();
+	if (now - lastSample < 1000)
+		return;
+	std::string path = "/sys/class/net/" + uplinkInterface + "/statistics/";
+	uint64_t rx = readCounter(path + "rx_bytes");
+	uint64_t tx = readCounter(path + "tx_bytes");
+	if (lastSample != 0 && rx >= lastRx && tx >= lastTx)
+		uplinkMbps = (double)std::max(rx - lastRx, tx - lastTx) * 8.0 / 1000.0 / (double)(now - lastSample);
+	lastSample = now;
+	lastRx = rx;
+	lastTx = tx;
+}
+
+// Returns why a new session can't be accepted, or REJECT_NONE
+static RejectReason overloaded()
+{
+	if (sessions.size() >= maxSessions)
+		return REJECT_FULL;
+	if (maxLoad > 0)
+	{
+		static const long cpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+		double load;
+		if (getloadavg(&load, 1) == 1 && load / (double)cpus >= maxLoad)
+			return REJECT_OVERLOADED;
+	}
+	if (maxUplinkMbps > 0 && uplinkMbps >= maxUplinkMbps)
+		return REJECT_BANDWIDTH;
+	return REJECT_NONE;
+}
+
+// Reject or redirect a new session if a threshold is reached. Returns true if the session can start.
+static bool admitSession(const PendingConnection& conn)
+{
+	if (maxSessionsPerSource > 0 && sourceSessions(conn.ip) >= maxSessionsPerSource)
+	{
+		// Not redirected: another access point isn't the answer to a per-address limit
+		fprintf(stderr, "[%s] %s:%d: too many sessions from this address, connection refused\n", getDate(), conn.ip.c_str(), conn.port);
+		uint8_t version = conn.prolog[7];
+		if (version >= PROLOG_V2) {
+			static const char message[] = "too many sessions from your address";
+			uint8_t reject[sizeof(message)];
+			reject[0] = REJECT_FULL;
+			memcpy(&reject[1], message, sizeof(message) - 1);
+			sendPrologReply(conn.sock, version, PROLOG_REJECT, reject, sizeof(reject));
+		}
+		return false;
+	}
+	RejectReason reason = overloaded();
+	if (reason == REJECT_NONE)
+		return true;
+	static const char * const messages[] = { "", "full", "overloaded", "bandwidth", "version" };
+	const char *message = messages[reason];
+	uint8_t version = conn.prolog[7];
+	if (!redirectHost.empty() && version >= PROLOG_V2)
+	{
+		fprintf(stderr, "[%s] %s:%d: %s, redirected to %s:%d\n", getDate(), conn.ip.c_str(), conn.port, message,
+				redirectHost.c_str(), redirectPort);
+		uint8_t redirect[PROLOG_REPLY_MAX];
+		uint16_t port = htons(redirectPort);
+		memcpy(&redirect[0], &port, sizeof(port));
+		size_t len = std::min(redirectHost.length(), sizeof(redirect) - 2);
+		memcpy(&redirect[2], redirectHost.c_str(), len);
+		sendPrologReply(conn.sock, version, PROLOG_REDIRECT, redirect, len + 2);
+	}
+	else
+	{
+		fprintf(stderr, "[%s] %s:%d: %s, connection refused (%zu sessions)\n", getDate(), conn.ip.c_str(), conn.port, message,
+				sessions.size());
+		if (version >= PROLOG_V2) {
+			uint8_t reject[32];
+			reject[0] = reason;
+			size_t len = strlen(message);
+			memcpy(&reject[1], message, len);
+			sendPrologReply(conn.sock, version, PROLOG_REJECT, reject, len + 1);
+		}
+	}
+	return false;
+}
+
+// Fork a session child. Returns its pid in the parent, 0 in the child with the child end of the control socket in ctrl.
+// sock is the session socket, which is kept open in the child.
+static pid_t forkSession(const std::string& ip, int sock, int& ctrl)
+{
+	int ctrlPair[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ctrlPair)) {
+		perror("socketpair");
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(ctrlPair[0]);
+		close(ctrlPair[1]);
+		return -1;
+	}
+	if (pid == 0)
+	{
+		// Sessions don't wait for their children
+		signal(SIGCHLD, SIG_IGN);
+		sigset_t sigset;
+		sigemptyset(&sigset);
+		sigaddset(&sigset, SIGCHLD);
+		sigaddset(&sigset, SIGUSR2);
+		sigprocmask(SIG_UNBLOCK, &sigset, nullptr);
+		close(listenSock);
+		for (const PendingConnection& conn : pending)
+			if (conn.sock != sock)
+				close(conn.sock);
+		for (const auto& [pid, session] : sessions)
+			if (session.ctrl >= 0)
+				close(session.ctrl);
+		close(ctrlPair[0]);
+		ctrl = ctrlPair[1];
+		return 0;
+	}
+	close(ctrlPair[1]);
+	sessions[pid] = { ip, ctrlPair[0] };
+	return pid;
+}
+
+static void startSession(const PendingConnection& conn)
+{
+	int ctrl;
+	pid_t pid = forkSession(conn.ip, conn.sock, ctrl);
+	if (pid == 0)
+	{
+		remoteIp = conn.ip;
+		remotePort = conn.port;
+		handleConnection(conn.sock, conn.prolog[7], ctrl);
+		exit(0);
+	}
+	uint8_t version = conn.prolog[7];
+	if (pid < 0 && version >= PROLOG_V2)
+	{
+		// Closing without a reply would make the client fall back to an older prolog version
+		uint8_t reject[] = { REJECT_FULL, 'f', 'u', 'l', 'l' };
+		sendPrologReply(conn.sock, version, PROLOG_REJECT, reject, sizeof(reject));
+	}
+}
+
+// Let the child that resumes a session start, or quit if the old child has kept the session
+static void startSuccessor(Session& session, bool start)
+{
+	if (session.successor == 0)
+		return;
+	auto it = sessions.find(session.successor);
+	session.successor = 0;
+	if (it != sessions.end() && it->second.ctrl >= 0)
+		send(it->second.ctrl, start ? "G" : "X", 1, MSG_NOSIGNAL);
+}
+
+// Receive a session from a child of the previous ethtap process and start a new child for it
+static void takeOverSession(Session& session)
+{
+	SessionState state;
+	iovec iov { &state, sizeof(state) };
+	union {
+		cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t len = recvmsg(session.ctrl, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		// Session ended
+		startSuccessor(session, true);
+		close(session.ctrl);
+		session.ctrl = -1;
+		return;
+	}
+	if (len == 1) {
+		// End of a handoff: the old child has quit ('Q') or kept the session ('C')
+		startSuccessor(session, *(char *)&state == 'Q');
+		return;
+	}
+	int fds[3] = { -1, -1, -1 };
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fds, CMSG_DATA(cmsg), std::min(sizeof(fds), (size_t)(cmsg->cmsg_len - CMSG_LEN(0))));
+	if (len != sizeof(state) || state.magic != HANDOFF_MAGIC || state.layout != HANDOFF_LAYOUT || fds[0] < 0 || fds[1] < 0)
+	{
+		// Sent by an incompatible version: the old child keeps the session
+		fprintf(stderr, "[%s] Invalid session handoff from %s (%zd bytes, layout %u)\n", getDate(), session.ip.c_str(), len,
+				len >= (ssize_t)offsetof(SessionState, remoteIp) ? state.layout : 0);
+		for (int fd : fds)
+			if (fd >= 0)
+				close(fd);
+		send(session.ctrl, "N", 1, MSG_NOSIGNAL);
+		return;
+	}
+	state.remoteIp[sizeof(state.remoteIp) - 1] = '\0';
+	state.tapName[sizeof(state.tapName) - 1] = '\0';
+	state.dcnetIp[sizeof(state.dcnetIp) - 1] = '\0';
+	int ctrl;
+	pid_t pid = forkSession(state.remoteIp, fds[0], ctrl);
+	if (pid == 0)
+	{
+		child_pipe = fds[2];
+		resumeSession(fds[0], fds[1], ctrl, state);
+		exit(0);
+	}
+	for (int fd : fds)
+		if (fd >= 0)
+			close(fd);
+	// The old child quits and the new one then starts, or the old one keeps the session if the fork failed
+	if (pid > 0)
+		session.successor = pid;
+	send(session.ctrl, pid > 0 ? "A" : "N", 1, MSG_NOSIGNAL);
+}
+
+// Send the reloaded redirections to the running sessions, so that they don't resolve host names themselves
+static void updateSessionRedirects()
+{
+	std::vector<uint8_t> msg = encodeRedirects();
+	msg.insert(msg.begin(), 'R');
+	if (msg.size() > CTRL_MSG_SIZE) {
+		fprintf(stderr, "[%s] Too many redirections to update the running sessions\n", getDate());
+		return;
+	}
+	for (const auto& [pid, session] : sessions)
+		if (session.ctrl >= 0 && send(session.ctrl, msg.data(), msg.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+			perror("send(redirections)");
+}
+
+// Execute the ethtap binary again, keeping the listening socket and the session control sockets open.
+// The sessions are then handed over to the new process.
+static void hotRestart()
+{
+	restartRequested = 0;
+	fprintf(stderr, "[%s] Hot restart with %zu sessions\n", getDate(), sessions.size());
+	for (const PendingConnection& conn : pending)
+		close(conn.sock);
+	pending.clear();
+	std::string sessionList;
+	fcntl(listenSock, F_SETFD, 0);
+	for (const auto& [pid, session] : sessions)
+	{
+		if (session.ctrl < 0)
+			continue;
+		fcntl(session.ctrl, F_SETFD, 0);
+		if (!sessionList.empty())
+			sessionList += ';';
+		sessionList += std::to_string(pid) + ',' + std::to_string(session.ctrl) + ',' + session.ip;
+	}
+	setenv("ETHTAP_LISTEN_FD", std::to_string(listenSock).c_str(), 1);
+	setenv("ETHTAP_SESSIONS", sessionList.c_str(), 1);
+	execv(exePath, savedArgv);
+	perror(exePath);
+	// Keep running
+	unsetenv("ETHTAP_LISTEN_FD");
+	unsetenv("ETHTAP_SESSIONS");
+	fcntl(listenSock, F_SETFD, FD_CLOEXEC);
+	for (const auto& [pid, session] : sessions)
+		if (session.ctrl >= 0)
+			fcntl(session.ctrl, F_SETFD, FD_CLOEXEC);
+}
+
+// Get the listening socket and sessions of the previous process after a hot restart.
+// Returns false if this isn't a hot restart.
+static bool inheritSessions()
+{
+	const char *listenFd = getenv("ETHTAP_LISTEN_FD");
+	const char *sessionList = getenv("ETHTAP_SESSIONS");
+	if (listenFd == nullptr || sessionList == nullptr)
+		return false;
+	listenSock = atoi(listenFd);
+	fcntl(listenSock, F_SETFD, FD_CLOEXEC);
+	for (const char *p = sessionList; *p != '\0'; )
+	{
+		int pid, ctrl, n;
+		char ip[INET6_ADDRSTRLEN];
+		if (sscanf(p, "%d,%d,%45[^;]%n", &pid, &ctrl, ip, &n) != 3)
 			break;
+		p += n;
+		if (*p == ';')
+			p++;
+		fcntl(ctrl, F_SETFD, FD_CLOEXEC);
+		sessions[pid] = { ip, ctrl };
+		// Ask the session to hand itself over
+		if (write(ctrl, "H", 1) != 1) {
+			close(ctrl);
+			sessions[pid].ctrl = -1;
 		}
 	}
+	unsetenv("ETHTAP_LISTEN_FD");
+	unsetenv("ETHTAP_SESSIONS");
+	fprintf(stderr, "[%s] Hot restart: taking over %zu sessions\n", getDate(), sessions.size());
+	return true;
+}
 
+static void reapSessions()
+{
+	pid_t pid;
+	while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0)
+	{
+		auto it = sessions.find(pid);
+		if (it == sessions.end())
+			continue;
+		if (it->second.ctrl >= 0)
+		{
+			// A handoff may still be waiting in the control socket
+			takeOverSession(it->second);
+			if (it->second.ctrl >= 0)
+				close(it->second.ctrl);
+		}
+		sessions.erase(it);
+	}
+}
+
+static void sigchldHandler(int)
+{
+}
+
+static void sigusr2Handler(int)
+{
+	restartRequested = 1;
+}
+
+static void openListenSocket()
+{
 #ifdef IPV4_ONLY
-	int ssock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	sockaddr_in serveraddr{};
 	serveraddr.sin_family = AF_INET;
 	serveraddr.sin_addr.s_addr = INADDR_ANY;
 	serveraddr.sin_port = htons(7655);
 #else
-	int ssock = socket(AF_INET6, SOCK_STREAM, 0);
+	listenSock = socket(AF_INET6, SOCK_STREAM, 0);
 	// allow IPv4 too
 	const int v6only = 0;
-	setsockopt(ssock, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof(v6only));
+	setsockopt(listenSock, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&v6only, sizeof(v6only));
 	sockaddr_in6 serveraddr = { AF_INET6, htons(7655), 0, in6addr_any, 0 };
 #endif
 	const int reuseAddr = 1;
-	setsockopt(ssock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuseAddr, sizeof(reuseAddr));
+	setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuseAddr, sizeof(reuseAddr));
 
-	if (::bind(ssock, (sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
-		close(ssock);
+	if (::bind(listenSock, (sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+		close(listenSock);
 		error(1, errno, "bind");
 	}
-	listen(ssock, 5);
-	for (;;)
+	listen(listenSock, LISTEN_BACKLOG);
+	setNonBlocking(listenSock);
+}
+
+// Parse the access point of the -r option: <host>[:<port>] or [<IPv6 address>][:<port>]
+static bool parseRedirectHost(const std::string& arg)
+{
+	std::string host = arg;
+	std::string port;
+	bool hasPort = false;
+	if (!host.empty() && host[0] == '[')
 	{
-		sockaddr_storage src_addr;
-		socklen_t addr_len = sizeof(src_addr);
-		int sock = accept(ssock, (sockaddr *)&src_addr, &addr_len);
-		if (sock < 0) {
-			perror("accept");
+		size_t bracket = host.find(']');
+		if (bracket == std::string::npos || (bracket + 1 < host.length() && host[bracket + 1] != ':'))
+			return false;
+		hasPort = bracket + 1 < host.length();
+		if (hasPort)
+			port = host.substr(bracket + 2);
+		host = host.substr(1, bracket - 1);
+	}
+	else
+	{
+		size_t colon = host.find(':');
+		if (colon != std::string::npos)
+		{
+			// IPv6 addresses must be in brackets
+			if (host.find(':', colon + 1) != std::string::npos)
+				return false;
+			hasPort = true;
+			port = host.substr(colon + 1);
+			host = host.substr(0, colon);
+		}
+	}
+	if (host.empty())
+		return false;
+	if (hasPort)
+	{
+		char *end;
+		long value = strtol(port.c_str(), &end, 10);
+		if (port.empty() || *end != '\0' || value < 1 || value > 65535)
+			return false;
+		redirectPort = (uint16_t)value;
+	}
+	redirectHost = host;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	setvbuf(stdout, nullptr, _IOLBF, BUFSIZ);
+	// SIGCHLD and SIGUSR2 (hot restart) are only delivered while waiting in ppoll
+	struct sigaction sa {};
+	sa.sa_handler = sigchldHandler;
+	sigaction(SIGCHLD, &sa, nullptr);
+	sa.sa_handler = sigusr2Handler;
+	sigaction(SIGUSR2, &sa, nullptr);
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGCHLD);
+	sigaddset(&sigset, SIGUSR2);
+	sigset_t pollSigset;
+	sigprocmask(SIG_BLOCK, &sigset, &pollSigset);
+	sigdelset(&pollSigset, SIGCHLD);
+	sigdelset(&pollSigset, SIGUSR2);
+	savedArgv = argv;
+	if (readlink("/proc/self/exe", exePath, sizeof(exePath) - 1) < 0)
+		strncpy(exePath, argv[0], sizeof(exePath) - 1);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:c:d:i:k:l:n:p:q:r:s:u:")) != -1) {
+		switch (opt) {
+		case 'b':
+			maxUplinkMbps = atof(optarg);
+			break;
+		case 'c':
+			{
+				char *end;
+				long rate = strtol(optarg, &end, 10);
+				if (*end != '\0' || rate <= 0 || rate > UINT32_MAX / 1000) {
+					fprintf(stderr, "-c %s: the rate limit must be a positive number of kbit/s\n", optarg);
+					exit(1);
+				}
+				tapQdisc.rateKbps = (unsigned)rate;
+				break;
+			}
+		case 'd':
+			dnsmasq_conf = optarg;
+			break;
+		case 'i':
+			start_ip = optarg;
+			break;
+		case 'k':
+			deadPeerTimeout = std::max(3, atoi(optarg));
+			break;
+		case 'l':
+			maxLoad = atof(optarg);
+			break;
+		case 'n':
+			redirects_file = optarg;
+			break;
+		case 'p':
+			maxSessionsPerSource = (unsigned)std::max(0, atoi(optarg));
+			break;
+		case 'q':
+			tapQdisc.kind = strcmp(optarg, "none") ? optarg : nullptr;
+			break;
+		case 'r':
+			if (!parseRedirectHost(optarg)) {
+				fprintf(stderr, "-r %s: expected <host>[:<port>] or [<IPv6 address>][:<port>], port 1 to 65535\n", optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			maxSessions = (size_t)std::max(0, atoi(optarg));
+			if (maxSessions > MAX_CONNECTIONS) {
+				fprintf(stderr, "-s %s: at most %d sessions are supported\n", optarg, MAX_CONNECTIONS);
+				maxSessions = MAX_CONNECTIONS;
+			}
+			break;
+		case 'u':
+			uplinkInterface = optarg;
 			break;
 		}
-#ifdef IPV4_ONLY
-		sockaddr_in *ipv4addr = (sockaddr_in *)&src_addr;
-		remoteIp = inet_ntoa(ipv4addr->sin_addr);
-		remotePort = ntohs(ipv4addr->sin_port);
-#else
-		char hostname[255];
-		int port;
-		if (src_addr.ss_family == AF_INET) {
-			inet_ntop(AF_INET, &((sockaddr_in *)&src_addr)->sin_addr, hostname, sizeof(hostname));
-			port = ((sockaddr_in *)&src_addr)->sin_port;
+	}
+	if (maxUplinkMbps > 0 && uplinkInterface.empty())
+	{
+		uplinkInterface = defaultInterface();
+		if (uplinkInterface.empty()) {
+			fprintf(stderr, "Cannot determine the uplink interface. Use -u <interface>\n");
+			exit(1);
 		}
-		else {
-			inet_ntop(AF_INET6, &((sockaddr_in6 *)&src_addr)->sin6_addr, hostname, sizeof(hostname));
-			if (!strncmp(hostname, "::ffff:", 7))
-				// Get rid of the IPv6 prefix for IPv4-mapped addresses
-				memmove(hostname, hostname + 7, strlen(hostname) + 1 - 7);
-			port = ((sockaddr_in6 *)&src_addr)->sin6_port;
+	}
+	if (redirects_file != nullptr && !loadRedirects(redirects_file))
+		exit(1);
+
+	if (!inheritSessions())
+		openListenSocket();
+	std::vector<pollfd> fds;
+	std::vector<pid_t> fdPids;
+	for (;;)
+	{
+		if (restartRequested)
+			hotRestart();
+		reapSessions();
+		if (redirects_file != nullptr && checkRedirects())
+			updateSessionRedirects();
+		if (maxUplinkMbps > 0)
+			sampleUplink();
+		// The prolog of new connections is checked here so that nothing is forked for scanners and such
+		fds.clear();
+		fds.push_back({ listenSock, POLLIN, 0 });
+		int64_t now = getTimeMs();
+		int64_t timeout = -1;
+		for (const PendingConnection& conn : pending)
+		{
+			fds.push_back({ conn.sock, POLLIN, 0 });
+			int64_t t = std::max<int64_t>(0, conn.deadline - now);
+			if (timeout == -1 || t < timeout)
+				timeout = t;
 		}
-		remoteIp = hostname;
-		remotePort = ntohs(port);
-#endif
-		if (fork() == 0) {
-			close(ssock);
-			handleConnection(sock);
+		// Control sockets of the sessions, to receive them after a hot restart
+		fdPids.clear();
+		for (const auto& [pid, session] : sessions)
+			if (session.ctrl >= 0) {
+				fds.push_back({ session.ctrl, POLLIN, 0 });
+				fdPids.push_back(pid);
+			}
+		if (maxUplinkMbps > 0 && (timeout == -1 || timeout > 1000))
+			timeout = 1000;
+		// The redirections file is checked every 10 s
+		if (redirects_file != nullptr && (timeout == -1 || timeout > 10000))
+			timeout = 10000;
+		timespec ts { (time_t)(timeout / 1000), (long)(timeout % 1000) * 1000000 };
+		if (ppoll(fds.data(), fds.size(), timeout == -1 ? nullptr : &ts, &pollSigset) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		for (size_t i = 0; i < fdPids.size(); i++)
+		{
+			if (fds[1 + pending.size() + i].revents == 0)
+				continue;
+			auto it = sessions.find(fdPids[i]);
+			if (it != sessions.end() && it->second.ctrl >= 0)
+				takeOverSession(it->second);
+		}
+		now = getTimeMs();
+		for (size_t i = pending.size(); i-- > 0; )
+		{
+			PendingConnection& conn = pending[i];
+			int rc = 0;
+			if (fds[i + 1].revents != 0)
+				rc = readProlog(conn);
+			if (rc == 0 && now >= conn.deadline) {
+				fprintf(stderr, "[%s] %s:%d: Prolog timeout\n", getDate(), conn.ip.c_str(), conn.port);
+				rc = -1;
+			}
+			if (rc == 0)
+				continue;
+			if (rc > 0 && admitSession(conn))
+				startSession(conn);
+			close(conn.sock);
+			pending.erase(pending.begin() + (long)i);
 		}
-		close(sock);
+		if (fds[0].revents & POLLIN)
+			acceptConnections();
 	}
-	close(ssock);
+	close(listenSock);
 	return 0;
 }
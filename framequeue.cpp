@@ -0,0 +1,168 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "framequeue.h"
+#include "classify.h"
+#include <cstring>
+#include <cmath>
+
+// Don't drop when less than a full frame is queued
+constexpr size_t MTU = 1514;
+
+FrameQueue::FrameQueue(int64_t target, int64_t interval, int64_t deadline, size_t maxBytes)
+	: target(target), interval(interval), deadline(deadline), maxBytes(maxBytes)
+{
+}
+
+void FrameQueue::push(const uint8_t *frame, size_t len, int64_t now)
+{
+	if (len > MAX_FRAME_SIZE) {
+		dropped++;
+		return;
+	}
+	while (count == MAX_FRAMES || (count > 0 && bytes + len > maxBytes))
+		drop();
+	Frame& f = frames[(first + count) % MAX_FRAMES];
+	f.enqueued = now;
+	f.len = (uint16_t)len;
+	memcpy(f.data, frame, len);
+	count++;
+	bytes += len;
+}
+
+void FrameQueue::removeHead()
+{
+	bytes -= head()->len;
+	first = (first + 1) % MAX_FRAMES;
+	count--;
+}
+
+void FrameQueue::drop()
+{
+	removeHead();
+	dropped++;
+}
+
+const FrameQueue::Frame *FrameQueue::doDequeue(int64_t now, bool& okToDrop)
+{
+	okToDrop = false;
+	// Frames past their deadline are never sent
+	while (count > 0 && now - head()->enqueued > deadline)
+		drop();
+	if (count == 0) {
+		firstAboveTime = 0;
+		return nullptr;
+	}
+	const Frame *f = head();
+	current.enqueued = f->enqueued;
+	current.len = f->len;
+	memcpy(current.data, f->data, f->len);
+	removeHead();
+
+	int64_t sojourn = now - current.enqueued;
+	if (sojourn < target || bytes <= MTU) {
+		firstAboveTime = 0;
+	}
+	else if (firstAboveTime == 0) {
+		firstAboveTime = now + interval;
+	}
+	else if (now >= firstAboveTime) {
+		okToDrop = true;
+	}
+	return &current;
+}
+
+int64_t FrameQueue::controlLaw(int64_t t) const
+{
+	return t + (int64_t)((double)interval / std::sqrt((double)dropCount));
+}
+
+size_t FrameQueue::pop(uint8_t *buf, size_t size, int64_t now)
+{
+	bool okToDrop;
+	const Frame *f = doDequeue(now, okToDrop);
+	if (f == nullptr) {
+		dropping = false;
+		return 0;
+	}
+	if (dropping)
+	{
+		if (!okToDrop) {
+			dropping = false;
+		}
+		else
+		{
+			while (now >= dropNext && dropping)
+			{
+				dropped++;
+				dropCount++;
+				f = doDequeue(now, okToDrop);
+				if (f == nullptr || !okToDrop)
+					dropping = false;
+				else
+					dropNext = controlLaw(dropNext);
+			}
+		}
+	}
+	else if (okToDrop)
+	{
+		dropped++;
+		f = doDequeue(now, okToDrop);
+		dropping = true;
+		unsigned delta = dropCount - lastCount;
+		dropCount = delta > 1 && now - dropNext < 16 * interval ? delta : 1;
+		dropNext = controlLaw(now);
+		lastCount = dropCount;
+	}
+	// Frames that don't fit in buf are dropped: the next one is returned instead
+	while (f != nullptr && f->len > size)
+	{
+		dropped++;
+		f = doDequeue(now, okToDrop);
+	}
+	if (f == nullptr)
+		return 0;
+	memcpy(buf, f->data, f->len);
+	return f->len;
+}
+
+void TunnelQueue::push(const uint8_t *frame, size_t len, int64_t now)
+{
+	if (classifyFrame(frame, len) == FRAME_GAME)
+		game.push(frame, len, now);
+	else
+		bulk.push(frame, len, now);
+}
+
+size_t TunnelQueue::pop(uint8_t *buf, size_t size, int64_t now)
+{
+	if (!bulk.empty() && (game.empty() || gameRun >= BULK_SHARE))
+	{
+		gameRun = 0;
+		size_t len = bulk.pop(buf, size, now);
+		if (len > 0)
+			return len;
+	}
+	size_t len = game.pop(buf, size, now);
+	if (len > 0)
+	{
+		if (!bulk.empty())
+			gameRun++;
+		return len;
+	}
+	return bulk.pop(buf, size, now);
+}
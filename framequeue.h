@@ -0,0 +1,114 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Queue of ethernet frames waiting to be sent to a BBA client.
+// Frames that stay queued too long are dropped, following the CoDel algorithm (RFC 8289),
+// or unconditionally when they are older than the deadline.
+// Times are in microseconds.
+class FrameQueue
+{
+public:
+	static constexpr size_t MAX_FRAMES = 64;
+	static constexpr size_t MAX_FRAME_SIZE = 1600;
+
+	FrameQueue(int64_t target, int64_t interval, int64_t deadline, size_t maxBytes);
+
+	// Add a frame to the queue. The oldest frames are dropped if it's full.
+	// Frames larger than MAX_FRAME_SIZE are dropped.
+	void push(const uint8_t *frame, size_t len, int64_t now);
+	// Copy the next frame to send to buf, after dropping the stale ones and the ones larger than size.
+	// Returns the frame size, or 0 if the queue is empty.
+	size_t pop(uint8_t *buf, size_t size, int64_t now);
+
+	bool empty() const {
+		return count == 0;
+	}
+	uint64_t droppedFrames() const {
+		return dropped;
+	}
+
+private:
+	struct Frame
+	{
+		int64_t enqueued;
+		uint16_t len;
+		uint8_t data[MAX_FRAME_SIZE];
+	};
+
+	Frame *head() {
+		return &frames[first];
+	}
+	void removeHead();
+	void drop();
+	// Pop the head frame and tell if it has been queued too long. Returns nullptr if the queue is empty.
+	const Frame *doDequeue(int64_t now, bool& okToDrop);
+	int64_t controlLaw(int64_t t) const;
+
+	const int64_t target;
+	const int64_t interval;
+	const int64_t deadline;
+	const size_t maxBytes;
+
+	Frame frames[MAX_FRAMES];
+	size_t first = 0;
+	size_t count = 0;
+	size_t bytes = 0;
+	uint64_t dropped = 0;
+
+	// CoDel state
+	int64_t firstAboveTime = 0;
+	int64_t dropNext = 0;
+	unsigned dropCount = 0;
+	unsigned lastCount = 0;
+	bool dropping = false;
+	// The frame returned by doDequeue, removed from the queue
+	Frame current;
+};
+
+// Output queue of one direction of the BBA tunnel: game frames are sent first,
+// bulk frames get one turn out of BULK_SHARE when both kinds are waiting.
+class TunnelQueue
+{
+public:
+	static constexpr unsigned BULK_SHARE = 8;
+
+	TunnelQueue(int64_t target, int64_t interval, int64_t deadline, size_t maxBytes)
+		: game(target, interval, deadline, maxBytes), bulk(target, interval, deadline, maxBytes) {
+	}
+
+	// Classify and queue a frame
+	void push(const uint8_t *frame, size_t len, int64_t now);
+	// Copy the next frame to send to buf. Returns the frame size, or 0 if both queues are empty.
+	size_t pop(uint8_t *buf, size_t size, int64_t now);
+
+	bool empty() const {
+		return game.empty() && bulk.empty();
+	}
+	uint64_t droppedFrames() const {
+		return game.droppedFrames() + bulk.droppedFrames();
+	}
+
+private:
+	FrameQueue game;
+	FrameQueue bulk;
+	// Game frames sent in a row while bulk frames were waiting
+	unsigned gameRun = 0;
+};
@@ -0,0 +1,323 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "pingxdp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+
+// discoping protocol. Must match discoping.c
+#define MAGIC 0xDC15C001
+#define PING 1
+#define PONG 2
+#define PING_SIZE 13
+
+// Offsets in an untagged ethernet frame carrying an IPv4 packet without options
+#define ETH_TYPE 12
+#define IP_VERSION_IHL 14
+#define IP_FRAG 20
+#define IP_PROTO 23
+#define IP_SADDR 26
+#define IP_DADDR 30
+#define UDP_SPORT 34
+#define UDP_DPORT 36
+#define UDP_LEN 38
+#define UDP_CSUM 40
+#define PAYLOAD 42
+
+#define INSN(CODE, DST, SRC, OFF, IMM) \
+	((struct bpf_insn){ .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+#define MOV64_REG(DST, SRC) INSN(BPF_ALU64 | BPF_MOV | BPF_X, DST, SRC, 0, 0)
+#define MOV64_IMM(DST, IMM) INSN(BPF_ALU64 | BPF_MOV | BPF_K, DST, 0, 0, IMM)
+#define ADD64_IMM(DST, IMM) INSN(BPF_ALU64 | BPF_ADD | BPF_K, DST, 0, 0, IMM)
+#define AND32_IMM(DST, IMM) INSN(BPF_ALU | BPF_AND | BPF_K, DST, 0, 0, IMM)
+#define LDX_MEM(SIZE, DST, SRC, OFF) INSN(BPF_LDX | BPF_MEM | (SIZE), DST, SRC, OFF, 0)
+#define STX_MEM(SIZE, DST, SRC, OFF) INSN(BPF_STX | BPF_MEM | (SIZE), DST, SRC, OFF, 0)
+#define ST_MEM(SIZE, DST, OFF, IMM) INSN(BPF_ST | BPF_MEM | (SIZE), DST, 0, OFF, IMM)
+#define ATOMIC_ADD64(DST, SRC, OFF) INSN(BPF_STX | BPF_ATOMIC | BPF_DW, DST, SRC, OFF, BPF_ADD)
+#define LD_MAP_FD(DST, FD) \
+	INSN(BPF_LD | BPF_IMM | BPF_DW, DST, BPF_PSEUDO_MAP_FD, 0, FD), INSN(0, 0, 0, 0, 0)
+#define JMP_REG(OP, DST, SRC, OFF) INSN(BPF_JMP | (OP) | BPF_X, DST, SRC, OFF, 0)
+#define JMP_IMM(OP, DST, IMM, OFF) INSN(BPF_JMP | (OP) | BPF_K, DST, 0, OFF, IMM)
+#define JMP32_IMM(OP, DST, IMM, OFF) INSN(BPF_JMP32 | (OP) | BPF_K, DST, 0, OFF, IMM)
+#define CALL(FUNC) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, FUNC)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+// Jump offset placeholder, replaced by the offset of the XDP_PASS exit
+#define PASS 0x7fff
+// Maximum number of IPv4 addresses of the interface
+#define MAX_LOCAL_ADDRESSES 16
+
+static int mapFd = -1;
+static int addrMapFd = -1;
+static int linkFd = -1;
+static char interface[IF_NAMESIZE];
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// Update the map of the IPv4 addresses of the interface. Returns the number of addresses.
+static int refreshLocalAddresses()
+{
+	struct ifaddrs *ifaddrs;
+	if (getifaddrs(&ifaddrs) < 0) {
+		perror("getifaddrs");
+		return 0;
+	}
+	uint32_t addrs[MAX_LOCAL_ADDRESSES];
+	int count = 0;
+	for (struct ifaddrs *ifa = ifaddrs; ifa != NULL && count < MAX_LOCAL_ADDRESSES; ifa = ifa->ifa_next)
+	{
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET || strcmp(ifa->ifa_name, interface))
+			continue;
+		addrs[count++] = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
+	}
+	freeifaddrs(ifaddrs);
+
+	// Remove the addresses that are gone
+	uint32_t stale[MAX_LOCAL_ADDRESSES];
+	int staleCount = 0;
+	uint32_t key;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t)addrMapFd;
+	attr.key = 0;
+	attr.next_key = (uint64_t)(uintptr_t)&key;
+	while (staleCount < MAX_LOCAL_ADDRESSES && bpf(BPF_MAP_GET_NEXT_KEY, &attr) == 0)
+	{
+		int found = 0;
+		for (int i = 0; i < count && !found; i++)
+			found = addrs[i] == key;
+		if (!found)
+			stale[staleCount++] = key;
+		attr.key = (uint64_t)(uintptr_t)&key;
+	}
+	for (int i = 0; i < staleCount; i++)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = (uint32_t)addrMapFd;
+		attr.key = (uint64_t)(uintptr_t)&stale[i];
+		if (bpf(BPF_MAP_DELETE_ELEM, &attr) < 0)
+			perror("bpf(BPF_MAP_DELETE_ELEM)");
+	}
+	int added = 0;
+	for (int i = 0; i < count; i++)
+	{
+		uint8_t value = 1;
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = (uint32_t)addrMapFd;
+		attr.key = (uint64_t)(uintptr_t)&addrs[i];
+		attr.value = (uint64_t)(uintptr_t)&value;
+		if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+			perror("bpf(BPF_MAP_UPDATE_ELEM)");
+		else
+			added++;
+	}
+	return added;
+}
+
+static void closeMaps()
+{
+	close(mapFd);
+	mapFd = -1;
+	close(addrMapFd);
+	addrMapFd = -1;
+}
+
+int pingXdpAttach(const char *ifname, uint16_t port)
+{
+	unsigned ifindex = if_nametoindex(ifname);
+	if (ifindex == 0) {
+		perror(ifname);
+		return -1;
+	}
+	// Needed for kernels older than 5.11 that charge bpf memory to RLIMIT_MEMLOCK
+	struct rlimit rlim = { RLIM_INFINITY, RLIM_INFINITY };
+	setrlimit(RLIMIT_MEMLOCK, &rlim);
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_ARRAY;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint64_t);
+	attr.max_entries = XDP_COUNTER_COUNT;
+	mapFd = bpf(BPF_MAP_CREATE, &attr);
+	if (mapFd < 0) {
+		perror("bpf(BPF_MAP_CREATE)");
+		return -1;
+	}
+	// Only PINGs sent to this host are answered, not the ones routed through it
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint8_t);
+	attr.max_entries = MAX_LOCAL_ADDRESSES;
+	addrMapFd = bpf(BPF_MAP_CREATE, &attr);
+	if (addrMapFd < 0) {
+		perror("bpf(BPF_MAP_CREATE)");
+		closeMaps();
+		return -1;
+	}
+	snprintf(interface, sizeof(interface), "%s", ifname);
+	if (refreshLocalAddresses() == 0) {
+		fprintf(stderr, "%s: no IPv4 address\n", ifname);
+		closeMaps();
+		return -1;
+	}
+
+	uint32_t magic = MAGIC;
+	struct bpf_insn prog[] = {
+		// r6 = data, r7 = data_end
+		LDX_MEM(BPF_W, BPF_REG_6, BPF_REG_1, offsetof(struct xdp_md, data)),
+		LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_1, offsetof(struct xdp_md, data_end)),
+		MOV64_REG(BPF_REG_2, BPF_REG_6),
+		ADD64_IMM(BPF_REG_2, PAYLOAD + PING_SIZE),
+		JMP_REG(BPF_JGT, BPF_REG_2, BPF_REG_7, PASS),
+		// IPv4, no options, not fragmented, UDP to our port, PING size
+		LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_6, ETH_TYPE),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, htons(ETH_P_IP), PASS),
+		LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_6, IP_VERSION_IHL),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, 0x45, PASS),
+		LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_6, IP_FRAG),
+		AND32_IMM(BPF_REG_2, htons(0x3fff)),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, 0, PASS),
+		LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_6, IP_PROTO),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, IPPROTO_UDP, PASS),
+		LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_6, UDP_DPORT),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, htons(port), PASS),
+		LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_6, UDP_LEN),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, htons(8 + PING_SIZE), PASS),
+		// magic and op
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, PAYLOAD),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, (int32_t)magic, PASS),
+		LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_6, PAYLOAD + 4),
+		JMP32_IMM(BPF_JNE, BPF_REG_2, PING, PASS),
+		// sent to a local address
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, IP_DADDR),
+		STX_MEM(BPF_W, BPF_REG_10, BPF_REG_2, -8),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, -8),
+		LD_MAP_FD(BPF_REG_1, addrMapFd),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JMP_IMM(BPF_JEQ, BPF_REG_0, 0, PASS),
+		// counters[XDP_PINGS_REFLECTED]++
+		ST_MEM(BPF_W, BPF_REG_10, -4, XDP_PINGS_REFLECTED),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, -4),
+		LD_MAP_FD(BPF_REG_1, mapFd),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2),
+		MOV64_IMM(BPF_REG_1, 1),
+		ATOMIC_ADD64(BPF_REG_0, BPF_REG_1, 0),
+		// swap MAC addresses
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, 0),
+		LDX_MEM(BPF_H, BPF_REG_3, BPF_REG_6, 4),
+		LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_6, 6),
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_6, 10),
+		STX_MEM(BPF_W, BPF_REG_6, BPF_REG_4, 0),
+		STX_MEM(BPF_H, BPF_REG_6, BPF_REG_5, 4),
+		STX_MEM(BPF_W, BPF_REG_6, BPF_REG_2, 6),
+		STX_MEM(BPF_H, BPF_REG_6, BPF_REG_3, 10),
+		// swap IP addresses. The IP checksum doesn't change.
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, IP_SADDR),
+		LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6, IP_DADDR),
+		STX_MEM(BPF_W, BPF_REG_6, BPF_REG_3, IP_SADDR),
+		STX_MEM(BPF_W, BPF_REG_6, BPF_REG_2, IP_DADDR),
+		// swap UDP ports
+		LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_6, UDP_SPORT),
+		LDX_MEM(BPF_H, BPF_REG_3, BPF_REG_6, UDP_DPORT),
+		STX_MEM(BPF_H, BPF_REG_6, BPF_REG_3, UDP_SPORT),
+		STX_MEM(BPF_H, BPF_REG_6, BPF_REG_2, UDP_DPORT),
+		// no UDP checksum
+		ST_MEM(BPF_H, BPF_REG_6, UDP_CSUM, 0),
+		ST_MEM(BPF_B, BPF_REG_6, PAYLOAD + 4, PONG),
+		MOV64_IMM(BPF_REG_0, XDP_TX),
+		EXIT(),
+		// PASS:
+		MOV64_IMM(BPF_REG_0, XDP_PASS),
+		EXIT(),
+	};
+	const int insnCount = (int)(sizeof(prog) / sizeof(prog[0]));
+	for (int i = 0; i < insnCount; i++)
+		if ((prog[i].code & 0x07) != BPF_LD && prog[i].off == PASS)
+			prog[i].off = (int16_t)(insnCount - 2 - i - 1);
+
+	static char log[65536];
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(uintptr_t)prog;
+	attr.insn_cnt = (uint32_t)insnCount;
+	attr.license = (uint64_t)(uintptr_t)"GPL";
+	attr.log_buf = (uint64_t)(uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	int progFd = bpf(BPF_PROG_LOAD, &attr);
+	if (progFd < 0) {
+		perror("bpf(BPF_PROG_LOAD)");
+		fprintf(stderr, "%s\n", log);
+		closeMaps();
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = (uint32_t)progFd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	linkFd = bpf(BPF_LINK_CREATE, &attr);
+	// the link holds a reference to the program
+	close(progFd);
+	if (linkFd < 0) {
+		perror("bpf(BPF_LINK_CREATE)");
+		closeMaps();
+		return -1;
+	}
+	return 0;
+}
+
+void pingXdpRefresh()
+{
+	if (linkFd >= 0)
+		refreshLocalAddresses();
+}
+
+uint64_t pingXdpCounter(int counter)
+{
+	if (mapFd < 0)
+		return 0;
+	uint32_t key = (uint32_t)counter;
+	uint64_t value = 0;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t)mapFd;
+	attr.key = (uint64_t)(uintptr_t)&key;
+	attr.value = (uint64_t)(uintptr_t)&value;
+	if (bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0)
+		return 0;
+	return value;
+}
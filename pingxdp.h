@@ -0,0 +1,42 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// XDP program answering discoping PINGs in the kernel
+enum {
+	XDP_PINGS_REFLECTED,
+	XDP_COUNTER_COUNT
+};
+
+// Attach the ping reflector to the given interface. Returns 0 on success.
+// The program is detached when the process exits.
+int pingXdpAttach(const char *ifname, uint16_t port);
+// Update the local addresses the program answers for, after an address change of the interface.
+void pingXdpRefresh(void);
+// Returns the value of one of the program counters, or 0 if not attached.
+uint64_t pingXdpCounter(int counter);
+
+#ifdef __cplusplus
+}	// extern "C"
+#endif
@@ -0,0 +1,57 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// DCNET prolog sent by BBA clients when connecting to ethtap:
+//   uint16_t length (6, host order), "DCNET", protocol version
+// Version 1 clients get no reply: frames are exchanged right away.
+// From version 2, ethtap replies before the first frame with:
+//   uint16_t length (host order), "DCNET", protocol version, status, data
+// PROLOG_ACCEPT: IPv4 address assigned to the console (network order)
+//   and from version 3, the heartbeat interval in seconds (uint16_t, network order)
+// PROLOG_REJECT: reason code, followed by a text message
+// PROLOG_REDIRECT: port (network order), followed by the host name or address to connect to instead
+// The connection is closed after a reject or a redirect.
+// The reply has the version of the prolog, or the latest version supported if it's lower.
+// From version 3, the client sends a heartbeat (zero-length frame) when nothing has been
+// sent or received for the given interval, and ethtap answers it. Either side can consider
+// the other one gone when nothing is received for 3 intervals.
+
+constexpr uint8_t PROLOG_V1 = 1;
+constexpr uint8_t PROLOG_V2 = 2;
+constexpr uint8_t PROLOG_V3 = 3;
+// Size of the prolog sent by clients, length included
+constexpr size_t PROLOG_SIZE = 8;
+// Maximum size of a reply, length included
+constexpr size_t PROLOG_REPLY_MAX = 256;
+
+enum PrologStatus : uint8_t {
+	PROLOG_ACCEPT,
+	PROLOG_REJECT,
+	PROLOG_REDIRECT,
+};
+
+enum RejectReason : uint8_t {
+	REJECT_NONE,
+	REJECT_FULL,			// maximum number of sessions reached
+	REJECT_OVERLOADED,		// CPU load too high
+	REJECT_BANDWIDTH,		// uplink bandwidth too high
+	REJECT_VERSION,			// unsupported protocol version
+};
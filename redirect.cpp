@@ -0,0 +1,519 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "redirect.h"
+#include "classify.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <ctime>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+constexpr time_t CHECK_INTERVAL = 10;
+// Mapping of redirected flows, set-associative with LRU replacement
+constexpr unsigned FLOW_SETS = 256;
+constexpr unsigned FLOW_WAYS = 4;
+// Idle flows can be replaced after this time
+constexpr time_t TCP_FLOW_TIMEOUT = 2 * 60 * 60;
+constexpr time_t FLOW_TIMEOUT = 5 * 60;
+// Fragments of a redirected datagram follow its first fragment, that holds the ports
+constexpr unsigned FRAGMENT_SLOTS = 64;
+constexpr time_t FRAGMENT_TIMEOUT = 30;
+
+// Offsets in an ethernet frame
+constexpr size_t ETH_TYPE = 12;
+constexpr size_t IP_HDR = 14;
+
+struct Redirect
+{
+	uint32_t net;		// network order
+	uint32_t mask;
+	uint8_t proto;		// 0 for any
+	std::vector<uint16_t> ports;	// host order, empty for any
+	uint32_t target;
+};
+
+struct Flow
+{
+	uint32_t consoleIp;
+	uint32_t target;
+	uint32_t origDest;
+	uint16_t consolePort;	// network order
+	uint16_t serverPort;
+	uint8_t proto;
+	time_t lastUsed;		// 0 if free
+};
+
+struct Fragment
+{
+	uint32_t src;
+	uint32_t dest;
+	uint16_t id;
+	uint8_t proto;
+	uint32_t target;
+	time_t lastUsed;		// 0 if free
+};
+
+static std::string redirectsPath;
+static std::vector<Redirect> redirects;
+// Distinct targets of the redirections, to quickly skip replies that don't need to be translated
+static std::vector<uint32_t> targets;
+static time_t lastModified;
+static time_t lastCheck;
+static Flow flows[FLOW_SETS][FLOW_WAYS];
+static Fragment fragments[FRAGMENT_SLOTS];
+
+static const char *getDate()
+{
+	time_t now;
+	time(&now);
+	char *nowstr = ctime(&now);
+	nowstr[strlen(nowstr) - 1] = '\0';
+	return nowstr;
+}
+
+static void setRedirects(std::vector<Redirect>& list);
+
+static bool resolve(const std::string& host, uint32_t& ip)
+{
+	in_addr addr;
+	if (inet_aton(host.c_str(), &addr)) {
+		ip = addr.s_addr;
+		return true;
+	}
+	addrinfo hints {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	addrinfo *result;
+	int rc = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+	if (rc != 0) {
+		fprintf(stderr, "[%s] %s: DNS failure: %s\n", getDate(), host.c_str(), gai_strerror(rc));
+		return false;
+	}
+	ip = ((sockaddr_in *)result->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo(result);
+	return true;
+}
+
+bool loadRedirects(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == nullptr) {
+		perror(path);
+		return false;
+	}
+	redirectsPath = path;
+	struct stat st;
+	if (fstat(fileno(f), &st) == 0)
+		lastModified = st.st_mtime;
+	lastCheck = time(nullptr);
+
+	// File format:
+	// <destination>[/<prefix length>] <protocol> <ports> <target>
+	// destination is an IP address or DNS name, protocol is tcp, udp or any,
+	// ports is a comma-separated list of destination ports or * for all.
+	// Ports only match tcp and udp, so "any" with ports means tcp and udp.
+	// Examples:
+	// 203.179.41.0/24 tcp * 172.20.0.1
+	// dcnet.flyca.st any * 172.20.0.1
+	// 146.185.135.179 tcp 9500,11000 172.20.0.1
+	std::vector<Redirect> list;
+	char line[256];
+	int lineNum = 0;
+	while (fgets(line, sizeof(line), f) != nullptr)
+	{
+		lineNum++;
+		char *comment = strchr(line, '#');
+		if (comment != nullptr)
+			*comment = '\0';
+		char dest[256], proto[16], ports[128], target[64];
+		int fields = sscanf(line, "%255s %15s %127s %63s", dest, proto, ports, target);
+		if (fields <= 0)
+			continue;
+		if (fields != 4) {
+			fprintf(stderr, "%s:%d: Invalid redirection\n", path, lineNum);
+			continue;
+		}
+		Redirect redirect {};
+		int prefixLen = 32;
+		char *slash = strchr(dest, '/');
+		if (slash != nullptr)
+		{
+			*slash = '\0';
+			prefixLen = atoi(slash + 1);
+			if (prefixLen < 0 || prefixLen > 32) {
+				fprintf(stderr, "%s:%d: Invalid prefix length\n", path, lineNum);
+				continue;
+			}
+		}
+		redirect.mask = prefixLen == 0 ? 0 : htonl(0xffffffffu << (32 - prefixLen));
+		if (!resolve(dest, redirect.net))
+			continue;
+		redirect.net &= redirect.mask;
+		if (!strcmp(proto, "tcp"))
+			redirect.proto = IPPROTO_TCP;
+		else if (!strcmp(proto, "udp"))
+			redirect.proto = IPPROTO_UDP;
+		else if (strcmp(proto, "any")) {
+			fprintf(stderr, "%s:%d: Invalid protocol %s\n", path, lineNum, proto);
+			continue;
+		}
+		// With protocol any, ports match tcp and udp packets
+		if (strcmp(ports, "*"))
+		{
+			for (char *p = strtok(ports, ","); p != nullptr; p = strtok(nullptr, ","))
+			{
+				int port = atoi(p);
+				if (port <= 0 || port > 65535) {
+					fprintf(stderr, "%s:%d: Invalid port %s\n", path, lineNum, p);
+					continue;
+				}
+				redirect.ports.push_back((uint16_t)port);
+			}
+			if (redirect.ports.empty())
+				continue;
+		}
+		in_addr addr;
+		if (!inet_aton(target, &addr)) {
+			fprintf(stderr, "%s:%d: Invalid target address %s\n", path, lineNum, target);
+			continue;
+		}
+		redirect.target = addr.s_addr;
+		list.push_back(redirect);
+	}
+	fclose(f);
+	setRedirects(list);
+	return true;
+}
+
+static void setRedirects(std::vector<Redirect>& list)
+{
+	redirects.swap(list);
+	targets.clear();
+	std::vector<uint16_t> gamePorts;
+	for (const Redirect& redirect : redirects)
+	{
+		if (std::find(targets.begin(), targets.end(), redirect.target) == targets.end())
+			targets.push_back(redirect.target);
+		for (uint16_t port : redirect.ports)
+			if (std::find(gamePorts.begin(), gamePorts.end(), port) == gamePorts.end())
+				gamePorts.push_back(port);
+	}
+	// The traffic to the redirected game server ports is latency sensitive
+	setGamePorts(gamePorts);
+	// Flows are kept so that established connections keep working
+}
+
+bool checkRedirects()
+{
+	time_t now = time(nullptr);
+	if (redirectsPath.empty() || now - lastCheck < CHECK_INTERVAL)
+		return false;
+	lastCheck = now;
+	struct stat st;
+	if (stat(redirectsPath.c_str(), &st) != 0 || st.st_mtime == lastModified)
+		return false;
+	if (!loadRedirects(redirectsPath.c_str()))
+		return false;
+	fprintf(stderr, "[%s] %s reloaded: %zd redirections\n", getDate(), redirectsPath.c_str(), redirects.size());
+	return true;
+}
+
+// Encoding: for each redirection, net, mask, target, protocol, port count and ports in host order
+std::vector<uint8_t> encodeRedirects()
+{
+	std::vector<uint8_t> data;
+	for (const Redirect& redirect : redirects)
+	{
+		uint8_t header[3 * sizeof(uint32_t) + 1 + sizeof(uint16_t)];
+		memcpy(&header[0], &redirect.net, sizeof(uint32_t));
+		memcpy(&header[4], &redirect.mask, sizeof(uint32_t));
+		memcpy(&header[8], &redirect.target, sizeof(uint32_t));
+		header[12] = redirect.proto;
+		uint16_t portCount = (uint16_t)redirect.ports.size();
+		memcpy(&header[13], &portCount, sizeof(portCount));
+		data.insert(data.end(), header, header + sizeof(header));
+		const uint8_t *ports = (const uint8_t *)redirect.ports.data();
+		data.insert(data.end(), ports, ports + portCount * sizeof(uint16_t));
+	}
+	return data;
+}
+
+bool decodeRedirects(const uint8_t *data, size_t len)
+{
+	std::vector<Redirect> list;
+	constexpr size_t HEADER_SIZE = 3 * sizeof(uint32_t) + 1 + sizeof(uint16_t);
+	while (len > 0)
+	{
+		if (len < HEADER_SIZE)
+			return false;
+		Redirect redirect {};
+		memcpy(&redirect.net, &data[0], sizeof(uint32_t));
+		memcpy(&redirect.mask, &data[4], sizeof(uint32_t));
+		memcpy(&redirect.target, &data[8], sizeof(uint32_t));
+		redirect.proto = data[12];
+		uint16_t portCount;
+		memcpy(&portCount, &data[13], sizeof(portCount));
+		data += HEADER_SIZE;
+		len -= HEADER_SIZE;
+		if (len < portCount * sizeof(uint16_t))
+			return false;
+		redirect.ports.resize(portCount);
+		memcpy(redirect.ports.data(), data, portCount * sizeof(uint16_t));
+		data += portCount * sizeof(uint16_t);
+		len -= portCount * sizeof(uint16_t);
+		list.push_back(redirect);
+	}
+	setRedirects(list);
+	return true;
+}
+
+// Incremental checksum update (RFC 1624) for an address change.
+// Values are in network order: the one's complement sum doesn't depend on byte order.
+static uint16_t checksumReplace(uint16_t check, uint32_t from, uint32_t to)
+{
+	uint32_t sum = (uint16_t)~check;
+	sum += (uint16_t)~(from & 0xffff);
+	sum += (uint16_t)~(from >> 16);
+	sum += to & 0xffff;
+	sum += to >> 16;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+// Parsed IPv4 packet
+struct Packet
+{
+	uint8_t *ip;
+	uint8_t *l4;		// nullptr for fragments other than the first one
+	size_t l4len;
+	uint8_t proto;
+	uint32_t src;
+	uint32_t dest;
+	uint16_t srcPort;	// network order. ICMP echo identifier.
+	uint16_t destPort;
+	uint16_t id;		// network order
+	bool moreFragments;
+};
+
+static bool parse(uint8_t *frame, size_t len, Packet& pkt)
+{
+	if (len < IP_HDR + 20 || frame[ETH_TYPE] != 0x08 || frame[ETH_TYPE + 1] != 0x00)
+		return false;
+	pkt.ip = frame + IP_HDR;
+	size_t ihl = (pkt.ip[0] & 0xf) * 4u;
+	if ((pkt.ip[0] >> 4) != 4 || ihl < 20 || len < IP_HDR + ihl)
+		return false;
+	pkt.proto = pkt.ip[9];
+	memcpy(&pkt.src, &pkt.ip[12], 4);
+	memcpy(&pkt.dest, &pkt.ip[16], 4);
+	pkt.l4 = nullptr;
+	pkt.l4len = len - IP_HDR - ihl;
+	pkt.srcPort = 0;
+	pkt.destPort = 0;
+	memcpy(&pkt.id, &pkt.ip[4], 2);
+	uint16_t frag;
+	memcpy(&frag, &pkt.ip[6], 2);
+	pkt.moreFragments = (ntohs(frag) & 0x2000) != 0;
+	if ((ntohs(frag) & 0x1fff) != 0)
+		return true;
+	pkt.l4 = pkt.ip + ihl;
+	switch (pkt.proto)
+	{
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		if (pkt.l4len < (pkt.proto == IPPROTO_TCP ? 20u : 8u))
+			return false;
+		memcpy(&pkt.srcPort, &pkt.l4[0], 2);
+		memcpy(&pkt.destPort, &pkt.l4[2], 2);
+		break;
+	case IPPROTO_ICMP:
+		// echo request or reply: use the identifier for both ports
+		if (pkt.l4len >= 8 && (pkt.l4[0] == 8 || pkt.l4[0] == 0)) {
+			memcpy(&pkt.srcPort, &pkt.l4[4], 2);
+			pkt.destPort = pkt.srcPort;
+		}
+		break;
+	}
+	return true;
+}
+
+// Replace the source or destination address and fix the checksums
+static void rewrite(Packet& pkt, size_t offset, uint32_t from, uint32_t to)
+{
+	memcpy(&pkt.ip[offset], &to, 4);
+	uint16_t check;
+	memcpy(&check, &pkt.ip[10], 2);
+	check = checksumReplace(check, from, to);
+	memcpy(&pkt.ip[10], &check, 2);
+	if (pkt.l4 == nullptr)
+		return;
+	// TCP and UDP checksums include a pseudo-header with the addresses
+	if (pkt.proto == IPPROTO_TCP)
+	{
+		memcpy(&check, &pkt.l4[16], 2);
+		check = checksumReplace(check, from, to);
+		memcpy(&pkt.l4[16], &check, 2);
+	}
+	else if (pkt.proto == IPPROTO_UDP)
+	{
+		memcpy(&check, &pkt.l4[6], 2);
+		if (check == 0)
+			// no checksum
+			return;
+		check = checksumReplace(check, from, to);
+		if (check == 0)
+			check = 0xffff;
+		memcpy(&pkt.l4[6], &check, 2);
+	}
+}
+
+static Flow *flowSet(uint32_t target, uint8_t proto, uint16_t consolePort, uint16_t serverPort)
+{
+	uint32_t h = (target ^ ((uint32_t)consolePort << 16 | serverPort) ^ proto) * 2654435761u;
+	return flows[h >> 24];
+}
+
+static Fragment& fragmentSlot(const Packet& pkt)
+{
+	uint32_t h = (pkt.src ^ pkt.dest ^ ((uint32_t)pkt.id << 8 | pkt.proto)) * 2654435761u;
+	return fragments[h >> 26];
+}
+
+// Target of the datagram of a fragment other than the first one, or 0 if not redirected
+static uint32_t fragmentTarget(const Packet& pkt)
+{
+	Fragment& f = fragmentSlot(pkt);
+	if (f.lastUsed == 0 || time(nullptr) - f.lastUsed >= FRAGMENT_TIMEOUT
+			|| f.src != pkt.src || f.dest != pkt.dest || f.id != pkt.id || f.proto != pkt.proto)
+		return 0;
+	f.lastUsed = time(nullptr);
+	return f.target;
+}
+
+// Remember the target of a fragmented datagram
+static void addFragment(const Packet& pkt, uint32_t target)
+{
+	Fragment& f = fragmentSlot(pkt);
+	f.src = pkt.src;
+	f.dest = pkt.dest;
+	f.id = pkt.id;
+	f.proto = pkt.proto;
+	f.target = target;
+	f.lastUsed = time(nullptr);
+}
+
+// Fragments other than the first one only match the redirections without ports
+static bool matches(const Redirect& redirect, const Packet& pkt)
+{
+	if ((pkt.dest & redirect.mask) != redirect.net)
+		return false;
+	if (redirect.proto != 0 && redirect.proto != pkt.proto)
+		return false;
+	if (redirect.ports.empty())
+		return true;
+	if (pkt.l4 == nullptr || (pkt.proto != IPPROTO_TCP && pkt.proto != IPPROTO_UDP))
+		return false;
+	return std::find(redirect.ports.begin(), redirect.ports.end(), ntohs(pkt.destPort)) != redirect.ports.end();
+}
+
+void redirectFromConsole(uint8_t *frame, size_t len)
+{
+	if (redirects.empty())
+		return;
+	Packet pkt;
+	if (!parse(frame, len, pkt))
+		return;
+	uint32_t target = pkt.l4 == nullptr ? fragmentTarget(pkt) : 0;
+	if (target == 0)
+		for (const Redirect& r : redirects)
+			if (matches(r, pkt)) {
+				target = r.target;
+				break;
+			}
+	if (target == 0)
+		return;
+	if (pkt.l4 != nullptr && pkt.moreFragments)
+		addFragment(pkt, target);
+	if (pkt.l4 != nullptr)
+	{
+		// remember the original destination for the replies
+		time_t now = time(nullptr);
+		Flow *set = flowSet(target, pkt.proto, pkt.srcPort, pkt.destPort);
+		Flow *flow = nullptr;
+		Flow *oldest = &set[0];
+		for (unsigned i = 0; i < FLOW_WAYS; i++)
+		{
+			Flow& f = set[i];
+			if (f.lastUsed != 0 && f.consoleIp == pkt.src && f.target == target && f.proto == pkt.proto
+					&& f.consolePort == pkt.srcPort && f.serverPort == pkt.destPort) {
+				flow = &f;
+				break;
+			}
+			if (f.lastUsed < oldest->lastUsed)
+				oldest = &f;
+		}
+		if (flow == nullptr)
+		{
+			flow = oldest;
+			time_t timeout = flow->proto == IPPROTO_TCP ? TCP_FLOW_TIMEOUT : FLOW_TIMEOUT;
+			if (flow->lastUsed != 0 && now - flow->lastUsed < timeout)
+				fprintf(stderr, "[%s] Redirection table full: active flow replaced\n", getDate());
+			flow->consoleIp = pkt.src;
+			flow->target = target;
+			flow->proto = pkt.proto;
+			flow->consolePort = pkt.srcPort;
+			flow->serverPort = pkt.destPort;
+		}
+		// Another server with the same ports redirected to the same target replaces the previous one
+		flow->origDest = pkt.dest;
+		flow->lastUsed = now;
+	}
+	rewrite(pkt, 16, pkt.dest, target);
+}
+
+void redirectToConsole(uint8_t *frame, size_t len)
+{
+	if (targets.empty())
+		return;
+	Packet pkt;
+	if (!parse(frame, len, pkt) || pkt.l4 == nullptr)
+		return;
+	if (std::find(targets.begin(), targets.end(), pkt.src) == targets.end())
+		return;
+	Flow *set = flowSet(pkt.src, pkt.proto, pkt.destPort, pkt.srcPort);
+	for (unsigned i = 0; i < FLOW_WAYS; i++)
+	{
+		Flow& f = set[i];
+		if (f.lastUsed != 0 && f.consoleIp == pkt.dest && f.target == pkt.src && f.proto == pkt.proto
+				&& f.consolePort == pkt.destPort && f.serverPort == pkt.srcPort)
+		{
+			f.lastUsed = time(nullptr);
+			rewrite(pkt, 12, pkt.src, f.origDest);
+			return;
+		}
+	}
+}
@@ -0,0 +1,43 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Game server redirection of console traffic (destination NAT), using the same
+// redirections file as iptables-dcnet.
+
+// Load the redirections, whose ports become the game ports of the frame classification.
+// Returns false if the file can't be read.
+bool loadRedirects(const char *path);
+// Reload the redirections if the file has been modified. Checked every few seconds at most.
+// Returns true if they have been reloaded. Host names are resolved synchronously:
+// only the ethtap parent process reloads the file, and passes the result to the sessions.
+bool checkRedirects();
+// Serialize the current redirections, with resolved addresses
+std::vector<uint8_t> encodeRedirects();
+// Replace the current redirections with serialized ones. Returns false if the data is invalid.
+bool decodeRedirects(const uint8_t *data, size_t len);
+// Rewrite the destination of an ethernet frame sent by the console if it matches a redirection.
+// Unlike iptables, ethtap doesn't reassemble IP fragments: the fragments of a datagram follow
+// its first fragment, the only one with ports. Fragments received before the first one
+// only match the redirections without ports.
+void redirectFromConsole(uint8_t *frame, size_t len);
+// Restore the original source of an ethernet frame sent to the console in reply to a redirected one
+void redirectToConsole(uint8_t *frame, size_t len);
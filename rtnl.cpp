@@ -0,0 +1,231 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "rtnl.h"
+#include <stdio.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+
+namespace {
+
+constexpr unsigned MAX_STEPS = 5;
+// Handle of the tbf root qdisc, when rate limiting
+constexpr uint32_t TBF_HANDLE = 1u << 16;
+
+// Netlink requests, concatenated in a single buffer and sent with one sendmsg
+class Batch
+{
+public:
+	// Optional steps are logged but don't fail the batch
+	nlmsghdr *add(const char *name, uint16_t type, uint16_t flags, const void *payload, size_t len, bool optional = false)
+	{
+		if (steps == MAX_STEPS || size + NLMSG_SPACE(len) > sizeof(buf))
+			return nullptr;
+		nlmsghdr *hdr = (nlmsghdr *)&buf[size];
+		memset(hdr, 0, NLMSG_SPACE(len));
+		hdr->nlmsg_len = (uint32_t)NLMSG_LENGTH(len);
+		hdr->nlmsg_type = type;
+		hdr->nlmsg_flags = (uint16_t)(flags | NLM_F_REQUEST | NLM_F_ACK);
+		hdr->nlmsg_seq = steps + 1;
+		memcpy(NLMSG_DATA(hdr), payload, len);
+		names[steps] = name;
+		optionals[steps++] = optional;
+		size += NLMSG_ALIGN(hdr->nlmsg_len);
+		return hdr;
+	}
+
+	// Append an attribute to the last message
+	bool attr(nlmsghdr *hdr, uint16_t type, const void *data, size_t len)
+	{
+		if (hdr == nullptr || size + RTA_SPACE(len) > sizeof(buf))
+			return false;
+		rtattr *rta = (rtattr *)&buf[size];
+		rta->rta_type = type;
+		rta->rta_len = (uint16_t)RTA_LENGTH(len);
+		if (len > 0)
+			memcpy(RTA_DATA(rta), data, len);
+		memset((uint8_t *)RTA_DATA(rta) + len, 0, RTA_SPACE(len) - RTA_LENGTH(len));
+		hdr->nlmsg_len = (uint32_t)(NLMSG_ALIGN(hdr->nlmsg_len) + RTA_SPACE(len));
+		size += RTA_SPACE(len);
+		return true;
+	}
+
+	// Start a nested attribute in the last message. The following attributes are added to it until endNest().
+	rtattr *nest(nlmsghdr *hdr, uint16_t type)
+	{
+		size_t offset = size;
+		if (!attr(hdr, type, nullptr, 0))
+			return nullptr;
+		return (rtattr *)&buf[offset];
+	}
+
+	void endNest(rtattr *rta)
+	{
+		if (rta != nullptr)
+			rta->rta_len = (uint16_t)(&buf[size] - (uint8_t *)rta);
+	}
+
+	// Send the batch and wait for all the acks. Returns false if any step failed.
+	bool run(const char *ifname)
+	{
+		int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (fd < 0) {
+			perror("socket(NETLINK_ROUTE)");
+			return false;
+		}
+		sockaddr_nl kernel {};
+		kernel.nl_family = AF_NETLINK;
+		if (sendto(fd, buf, size, 0, (sockaddr *)&kernel, sizeof(kernel)) != (ssize_t)size) {
+			perror("send(NETLINK_ROUTE)");
+			close(fd);
+			return false;
+		}
+		bool success = true;
+		unsigned acks = 0;
+		while (acks < steps)
+		{
+			uint8_t reply[4096];
+			ssize_t len = recv(fd, reply, sizeof(reply), 0);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("recv(NETLINK_ROUTE)");
+				success = false;
+				break;
+			}
+			for (nlmsghdr *hdr = (nlmsghdr *)reply; NLMSG_OK(hdr, (size_t)len); hdr = NLMSG_NEXT(hdr, len))
+			{
+				if (hdr->nlmsg_type != NLMSG_ERROR || hdr->nlmsg_seq == 0 || hdr->nlmsg_seq > steps)
+					continue;
+				acks++;
+				const nlmsgerr *err = (const nlmsgerr *)NLMSG_DATA(hdr);
+				if (err->error != 0)
+				{
+					unsigned step = hdr->nlmsg_seq - 1;
+					fprintf(stderr, "%s: %s failed: %s%s\n", ifname, names[step], strerror(-err->error),
+							optionals[step] ? " (ignored)" : "");
+					if (!optionals[step])
+						success = false;
+				}
+			}
+		}
+		close(fd);
+		return success;
+	}
+
+private:
+	alignas(nlmsghdr) uint8_t buf[1024];
+	size_t size = 0;
+	const char *names[MAX_STEPS];
+	bool optionals[MAX_STEPS];
+	unsigned steps = 0;
+};
+
+void addQdisc(Batch& batch, int ifindex, const QdiscConfig& qdisc)
+{
+	tcmsg tcm {};
+	tcm.tcm_family = AF_UNSPEC;
+	tcm.tcm_ifindex = ifindex;
+	tcm.tcm_parent = TC_H_ROOT;
+	nlmsghdr *hdr;
+	if (qdisc.rateKbps > 0)
+	{
+		tcm.tcm_handle = TBF_HANDLE;
+		hdr = batch.add("set rate limit", RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE, &tcm, sizeof(tcm), true);
+		batch.attr(hdr, TCA_KIND, "tbf", sizeof("tbf"));
+		tc_tbf_qopt tbf {};
+		uint64_t rate = (uint64_t)qdisc.rateKbps * 1000 / 8;
+		tbf.rate.rate = (uint32_t)std::min<uint64_t>(rate, UINT32_MAX);
+		// The rate table is computed by the kernel
+		tbf.rate.linklayer = TC_LINKLAYER_ETHERNET;
+		// Size of the default child qdisc (bfifo), if not replaced below
+		tbf.limit = qdisc.burst * 2;
+		rtattr *options = batch.nest(hdr, TCA_OPTIONS);
+		batch.attr(hdr, TCA_TBF_PARMS, &tbf, sizeof(tbf));
+		uint32_t burst = qdisc.burst;
+		batch.attr(hdr, TCA_TBF_BURST, &burst, sizeof(burst));
+		if (rate > UINT32_MAX)
+			batch.attr(hdr, TCA_TBF_RATE64, &rate, sizeof(rate));
+		batch.endNest(options);
+
+		tcm.tcm_handle = 0;
+		tcm.tcm_parent = TC_H_MAKE(TBF_HANDLE, 1);
+	}
+	if (qdisc.kind == nullptr)
+		// Keep the default qdisc
+		return;
+	hdr = batch.add("set qdisc", RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE, &tcm, sizeof(tcm), true);
+	batch.attr(hdr, TCA_KIND, qdisc.kind, strlen(qdisc.kind) + 1);
+	if (!strcmp(qdisc.kind, "fq_codel") && (qdisc.target != 0 || qdisc.interval != 0 || qdisc.limit != 0))
+	{
+		rtattr *options = batch.nest(hdr, TCA_OPTIONS);
+		if (qdisc.target != 0)
+			batch.attr(hdr, TCA_FQ_CODEL_TARGET, &qdisc.target, sizeof(qdisc.target));
+		if (qdisc.interval != 0)
+			batch.attr(hdr, TCA_FQ_CODEL_INTERVAL, &qdisc.interval, sizeof(qdisc.interval));
+		if (qdisc.limit != 0)
+			batch.attr(hdr, TCA_FQ_CODEL_LIMIT, &qdisc.limit, sizeof(qdisc.limit));
+		batch.endNest(options);
+	}
+}
+
+}
+
+int rtnlSetupInterface(const char *ifname, in_addr address, int prefixLen, int mtu, const QdiscConfig *qdisc)
+{
+	int ifindex = (int)if_nametoindex(ifname);
+	if (ifindex == 0) {
+		perror(ifname);
+		return -1;
+	}
+	Batch batch;
+
+	ifaddrmsg ifa {};
+	ifa.ifa_family = AF_INET;
+	ifa.ifa_prefixlen = (uint8_t)prefixLen;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa.ifa_index = (uint32_t)ifindex;
+	nlmsghdr *hdr = batch.add("set address", RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof(ifa));
+	batch.attr(hdr, IFA_LOCAL, &address, sizeof(address));
+	batch.attr(hdr, IFA_ADDRESS, &address, sizeof(address));
+
+	// Installed before the link is up so that no frame goes through the default qdisc
+	if (qdisc != nullptr)
+		addQdisc(batch, ifindex, *qdisc);
+
+	ifinfomsg ifi {};
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = ifindex;
+	ifi.ifi_flags = IFF_UP;
+	ifi.ifi_change = IFF_UP;
+	hdr = batch.add("set link up", RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+	uint32_t mtu32 = (uint32_t)mtu;
+	if (!batch.attr(hdr, IFLA_MTU, &mtu32, sizeof(mtu32))) {
+		fprintf(stderr, "%s: netlink request too large\n", ifname);
+		return -1;
+	}
+
+	return batch.run(ifname) ? 0 : -1;
+}
@@ -0,0 +1,39 @@
+/*
+	DCNet access point services.
+    Copyright (C) 2026 Flyinghead <flyinghead.github@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <netinet/in.h>
+
+// Queueing discipline of an interface
+struct QdiscConfig
+{
+	const char *kind;		// fq_codel, pfifo... or nullptr for the default
+	// fq_codel parameters, 0 for the kernel defaults
+	unsigned target;		// µs
+	unsigned interval;		// µs
+	unsigned limit;			// packets
+	// Rate limit enforced by a tbf root qdisc, with the qdisc above as its child. 0 for no limit.
+	// Being an egress qdisc, it only shapes the traffic sent to the console.
+	unsigned rateKbps;
+	unsigned burst;			// bytes
+};
+
+// Configure a network interface with a single rtnetlink request batch:
+// IPv4 address, MTU, root queueing discipline and link up.
+// The qdisc is optional: the default one is kept if it can't be installed.
+// Returns 0 on success, or -1 if any other step failed.
+int rtnlSetupInterface(const char *ifname, in_addr address, int prefixLen, int mtu, const QdiscConfig *qdisc);